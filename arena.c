@@ -0,0 +1,40 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+void arena_init(struct arena *a) {
+    a->head = NULL;
+    a->tail = NULL;
+    a->bytes = 0;
+}
+
+void arena_free(struct arena *a) {
+    while (a->head != NULL) {
+        struct arena_block *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    arena_init(a);
+}
+
+const char *arena_strdup(struct arena *a, const char *s, size_t len) {
+    if (a->tail == NULL || ARENA_BLOCK_SIZE - a->tail->used < len + 1) {
+        struct arena_block *b = malloc(sizeof *b);
+        if (b == NULL)
+            return NULL;
+        b->next = NULL;
+        b->used = 0;
+        if (a->tail != NULL)
+            a->tail->next = b;
+        else
+            a->head = b;
+        a->tail = b;
+    }
+
+    char *dst = a->tail->data + a->tail->used;
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    a->tail->used += len + 1;
+    a->bytes += len + 1;
+    return dst;
+}
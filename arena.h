@@ -0,0 +1,31 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE 65536
+
+// A block of packed null-terminated strings
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    char data[ARENA_BLOCK_SIZE];
+};
+
+// Append-only string storage. Strings are packed back to back without any
+// per-string malloc overhead and never move, so pointers into the arena stay
+// valid until arena_free().
+struct arena {
+    struct arena_block *head;       // oldest block, strings in insertion order
+    struct arena_block *tail;       // block being filled
+    size_t bytes;                   // total string bytes stored
+};
+
+void arena_init(struct arena *a);
+void arena_free(struct arena *a);
+
+// Copies len bytes of s plus a NULL into the arena; NULL if out of memory.
+// len must be less than ARENA_BLOCK_SIZE.
+const char *arena_strdup(struct arena *a, const char *s, size_t len);
+
+#endif
@@ -0,0 +1,424 @@
+#include <stdlib.h>
+#include <string.h>
+#include "catalog.h"
+#include "epoch.h"
+
+#define CATALOG_MIN_SLOTS 128
+#define CATALOG_BATCH 32
+#define CATALOG_RECENT_MAX 512       // names in the recent run before it is folded in
+#define CATALOG_CHUNK_SIZE (1u << CATALOG_CHUNK_SHIFT)
+
+static struct catalog_table *table_alloc(uint32_t slot_count) {
+    struct catalog_table *t = malloc(sizeof *t + (size_t)slot_count * sizeof t->slots[0]);
+    if (t == NULL)
+        return NULL;
+    t->mask = slot_count - 1;
+    memset(t->slots, 0xFF, (size_t)slot_count * sizeof t->slots[0]);
+    return t;
+}
+
+int catalog_init(struct catalog *cat) {
+    cat->entry_count = 0;
+    cat->sorted = NULL;
+    cat->recent = NULL;
+    arena_init(&cat->names);
+    cat->table = table_alloc(CATALOG_MIN_SLOTS);
+    cat->chunks = calloc(CATALOG_MAX_CHUNKS, sizeof *cat->chunks);
+    if (cat->table == NULL || cat->chunks == NULL) {
+        catalog_free(cat);
+        return -1;
+    }
+    return 0;
+}
+
+void catalog_free(struct catalog *cat) {
+    for (uint32_t id = 0; id < cat->entry_count; id++)
+        free(catalog_entry_by_id(cat, id)->holders);
+    if (cat->chunks != NULL) {
+        for (int i = 0; i < CATALOG_MAX_CHUNKS; i++)
+            free(cat->chunks[i]);
+    }
+    free(cat->chunks);
+    free(cat->table);
+    free(cat->sorted);
+    free(cat->recent);
+    arena_free(&cat->names);
+    cat->chunks = NULL;
+    cat->table = NULL;
+    cat->sorted = NULL;
+    cat->recent = NULL;
+    cat->entry_count = 0;
+}
+
+// 64-bit FNV-1a
+uint64_t catalog_hash(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+struct catalog_entry *catalog_entry_by_id(const struct catalog *cat, uint32_t id) {
+    // pairs with the release in catalog_intern: the entry is filled in first
+    if (id >= __atomic_load_n(&cat->entry_count, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &cat->chunks[id >> CATALOG_CHUNK_SHIFT][id & (CATALOG_CHUNK_SIZE - 1)];
+}
+
+const struct holder_list *catalog_holders(const struct catalog_entry *e) {
+    return __atomic_load_n(&e->holders, __ATOMIC_ACQUIRE);
+}
+
+uint32_t holder_list_count(const struct holder_list *hl) {
+    return hl == NULL ? 0 : __atomic_load_n(&hl->count, __ATOMIC_ACQUIRE);
+}
+
+const struct holder *holder_list_first(const struct holder_list *hl) {
+    uint32_t count = holder_list_count(hl);
+    for (uint32_t i = 0; i < count; i++) {
+        if (hl->h[i].socket_fd != HOLDER_NONE)
+            return &hl->h[i];
+    }
+    return NULL;
+}
+
+// Puts id in the first free slot of its probe sequence. Slots only ever go
+// from empty to an id, so a concurrent reader sees either.
+static void table_insert(struct catalog_table *t, uint64_t h, uint32_t id) {
+    uint32_t i = h & t->mask;
+    while (t->slots[i] != CATALOG_NONE)
+        i = (i + 1) & t->mask;
+    __atomic_store_n(&t->slots[i], id, __ATOMIC_RELEASE);
+}
+
+// Doubles the table once it is half full. Readers still on the old table
+// simply don't see names interned after the swap; it is freed once they
+// have all left.
+static int catalog_grow(struct catalog *cat) {
+    struct catalog_table *old = cat->table;
+    struct catalog_table *t = table_alloc((old->mask + 1) * 2);
+    if (t == NULL)
+        return -1;
+    for (uint32_t id = 0; id < cat->entry_count; id++)
+        table_insert(t, catalog_entry_by_id(cat, id)->hash, id);
+    __atomic_store_n(&cat->table, t, __ATOMIC_RELEASE);
+    epoch_retire(old);
+    return 0;
+}
+
+// Probes t for name starting at slot i
+static struct catalog_entry *catalog_probe(const struct catalog *cat, const struct catalog_table *t, uint32_t i, uint64_t h, const char *name) {
+    for (;; i = (i + 1) & t->mask) {
+        uint32_t id = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+        if (id == CATALOG_NONE)
+            return NULL;
+        struct catalog_entry *e = catalog_entry_by_id(cat, id);
+        if (e->hash == h && strcmp(e->name, name) == 0)
+            return e;
+    }
+}
+
+struct catalog_entry *catalog_find(const struct catalog *cat, const char *name) {
+    const struct catalog_table *t = __atomic_load_n(&cat->table, __ATOMIC_ACQUIRE);
+    uint64_t h = catalog_hash(name);
+    return catalog_probe(cat, t, h & t->mask, h, name);
+}
+
+void catalog_find_batch(const struct catalog *cat, const char *const *names, int n, struct catalog_entry **out) {
+    const struct catalog_table *t = __atomic_load_n(&cat->table, __ATOMIC_ACQUIRE);
+    for (int base = 0; base < n; base += CATALOG_BATCH) {
+        int m = n - base < CATALOG_BATCH ? n - base : CATALOG_BATCH;
+        uint64_t hashes[CATALOG_BATCH];
+        uint32_t firsts[CATALOG_BATCH];
+
+        // pass 1: hash every name and start loading its slot
+        for (int i = 0; i < m; i++) {
+            hashes[i] = catalog_hash(names[base + i]);
+            __builtin_prefetch(&t->slots[hashes[i] & t->mask]);
+        }
+        // pass 2: read the first slots and start loading their entries
+        for (int i = 0; i < m; i++) {
+            firsts[i] = __atomic_load_n(&t->slots[hashes[i] & t->mask], __ATOMIC_ACQUIRE);
+            if (firsts[i] != CATALOG_NONE)
+                __builtin_prefetch(catalog_entry_by_id(cat, firsts[i]));
+        }
+        // pass 3: probe
+        for (int i = 0; i < m; i++) {
+            out[base + i] = firsts[i] == CATALOG_NONE ? NULL
+                : catalog_probe(cat, t, hashes[i] & t->mask, hashes[i], names[base + i]);
+        }
+    }
+}
+
+static uint32_t run_count(const struct catalog_run *r) {
+    return r == NULL ? 0 : r->count;
+}
+
+// Index of the first id in r whose name is not less than name
+static uint32_t run_lower_bound(const struct catalog *cat, const struct catalog_run *r, const char *name) {
+    uint32_t lo = 0, hi = run_count(r);
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(catalog_entry_by_id(cat, r->ids[mid])->name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int catalog_prefix_search(const struct catalog *cat, const char *prefix, const char *after, int limit, uint32_t *out) {
+    // recent before sorted: a fold publishes sorted first, so a reader that
+    // sees the emptied recent also sees the sorted run it went into. The
+    // other way round an id can show up in both, which the merge skips.
+    const struct catalog_run *recent = __atomic_load_n(&cat->recent, __ATOMIC_ACQUIRE);
+    const struct catalog_run *sorted = __atomic_load_n(&cat->sorted, __ATOMIC_ACQUIRE);
+
+    // start at the first name >= max(prefix, after) in both runs
+    const char *start = strcmp(after, prefix) > 0 ? after : prefix;
+    uint32_t i = run_lower_bound(cat, sorted, start);
+    uint32_t j = run_lower_bound(cat, recent, start);
+
+    size_t prefix_len = strlen(prefix);
+    int n = 0;
+    while (n < limit && (i < run_count(sorted) || j < run_count(recent))) {
+        struct catalog_entry *e;
+        if (j == run_count(recent)) {
+            e = catalog_entry_by_id(cat, sorted->ids[i++]);
+        } else if (i == run_count(sorted)) {
+            e = catalog_entry_by_id(cat, recent->ids[j++]);
+        } else {
+            struct catalog_entry *a = catalog_entry_by_id(cat, sorted->ids[i]);
+            struct catalog_entry *b = catalog_entry_by_id(cat, recent->ids[j]);
+            int cmp = strcmp(a->name, b->name);
+            e = cmp <= 0 ? a : b;
+            i += cmp <= 0;
+            j += cmp >= 0;
+        }
+        if (strncmp(e->name, prefix, prefix_len) != 0)
+            break;
+        if (holder_list_count(catalog_holders(e)) > 0 && strcmp(e->name, after) != 0)
+            out[n++] = e->id;
+    }
+    return n;
+}
+
+// Substring matches can't use the name order, so this stays a scan of every
+// id; it takes no lock either.
+int catalog_substring_search(const struct catalog *cat, const char *pattern, const char *after, int limit, uint32_t *out) {
+    uint32_t id = 0;
+    if (after[0] != '\0') {
+        struct catalog_entry *e = catalog_find(cat, after);
+        if (e == NULL)
+            return 0;
+        id = e->id + 1;
+    }
+
+    uint32_t count = __atomic_load_n(&cat->entry_count, __ATOMIC_ACQUIRE);
+    int n = 0;
+    for (; id < count && n < limit; id++) {
+        struct catalog_entry *e = catalog_entry_by_id(cat, id);
+        if (holder_list_count(catalog_holders(e)) > 0 && strstr(e->name, pattern) != NULL)
+            out[n++] = id;
+    }
+    return n;
+}
+
+// Returns a copy of recent with id inserted in name order, folding the lot
+// into a new sorted run first if recent is full. The new runs are only
+// published by catalog_publish_runs(). Returns NULL if out of memory.
+static struct catalog_run *catalog_insert_sorted(struct catalog *cat, uint32_t id, const char *name, struct catalog_run **folded) {
+    struct catalog_run *recent = cat->recent;
+    *folded = NULL;
+    if (run_count(recent) == CATALOG_RECENT_MAX) {
+        // one linear merge every CATALOG_RECENT_MAX names: binary search
+        // where each recent id goes and copy the stretch of sorted before it
+        struct catalog_run *sorted = cat->sorted;
+        uint32_t total = run_count(sorted) + recent->count;
+        struct catalog_run *merged = malloc(sizeof *merged + (size_t)total * sizeof merged->ids[0]);
+        if (merged == NULL)
+            return NULL;
+        uint32_t from = 0, k = 0;
+        for (uint32_t j = 0; j < recent->count; j++) {
+            uint32_t to = run_lower_bound(cat, sorted, catalog_entry_by_id(cat, recent->ids[j])->name);
+            // sorted is NULL until the first fold, so only touch it when
+            // there is something to copy
+            if (to > from) {
+                memcpy(&merged->ids[k], &sorted->ids[from], (size_t)(to - from) * sizeof merged->ids[0]);
+                k += to - from;
+            }
+            merged->ids[k++] = recent->ids[j];
+            from = to;
+        }
+        if (run_count(sorted) > from)
+            memcpy(&merged->ids[k], &sorted->ids[from], (size_t)(sorted->count - from) * sizeof merged->ids[0]);
+        merged->count = total;
+        *folded = merged;
+        recent = NULL;
+    }
+
+    uint32_t count = run_count(recent);
+    struct catalog_run *r = malloc(sizeof *r + (size_t)(count + 1) * sizeof r->ids[0]);
+    if (r == NULL) {
+        free(*folded);
+        *folded = NULL;
+        return NULL;
+    }
+    uint32_t pos = run_lower_bound(cat, recent, name);
+    if (pos > 0)
+        memcpy(r->ids, recent->ids, (size_t)pos * sizeof r->ids[0]);
+    r->ids[pos] = id;
+    if (count > pos)
+        memcpy(&r->ids[pos + 1], &recent->ids[pos], (size_t)(count - pos) * sizeof r->ids[0]);
+    r->count = count + 1;
+    return r;
+}
+
+// Publishes the runs built by catalog_insert_sorted(), sorted first (see
+// catalog_prefix_search), and retires the ones they replace
+static void catalog_publish_runs(struct catalog *cat, struct catalog_run *recent, struct catalog_run *folded) {
+    if (folded != NULL) {
+        struct catalog_run *old = cat->sorted;
+        __atomic_store_n(&cat->sorted, folded, __ATOMIC_RELEASE);
+        epoch_retire(old);
+    }
+    struct catalog_run *old = cat->recent;
+    __atomic_store_n(&cat->recent, recent, __ATOMIC_RELEASE);
+    epoch_retire(old);
+}
+
+// Interns name as a new entry. The entry is filled in and counted before its
+// id goes into the table or the sorted runs, so a reader that finds the id
+// finds a whole entry.
+static struct catalog_entry *catalog_intern(struct catalog *cat, const char *name, uint64_t h) {
+    uint32_t id = cat->entry_count;
+    uint32_t chunk = id >> CATALOG_CHUNK_SHIFT;
+    if (chunk >= CATALOG_MAX_CHUNKS)
+        return NULL;
+    if (cat->chunks[chunk] == NULL) {
+        cat->chunks[chunk] = malloc(CATALOG_CHUNK_SIZE * sizeof(struct catalog_entry));
+        if (cat->chunks[chunk] == NULL)
+            return NULL;
+    }
+    // keep the load factor at or under one half so probes stay short
+    if ((id + 1) * 2 > cat->table->mask + 1 && catalog_grow(cat) == -1)
+        return NULL;
+
+    const char *copy = arena_strdup(&cat->names, name, strlen(name));
+    if (copy == NULL)
+        return NULL;
+
+    struct catalog_entry *e = &cat->chunks[chunk][id & (CATALOG_CHUNK_SIZE - 1)];
+    e->name = copy;
+    e->hash = h;
+    e->holders = NULL;
+    e->id = id;
+
+    struct catalog_run *folded;
+    struct catalog_run *recent = catalog_insert_sorted(cat, id, copy, &folded);
+    if (recent == NULL)
+        return NULL;
+    __atomic_store_n(&cat->entry_count, id + 1, __ATOMIC_RELEASE);
+    table_insert(cat->table, h, id);
+    catalog_publish_runs(cat, recent, folded);
+    return e;
+}
+
+// Copies the first count records of old into a new list with room for
+// capacity, or returns NULL if out of memory
+static struct holder_list *holder_list_copy(const struct holder_list *old, uint32_t count, uint32_t capacity) {
+    struct holder_list *hl = malloc(sizeof *hl + (size_t)capacity * sizeof hl->h[0]);
+    if (hl == NULL)
+        return NULL;
+    hl->count = count;
+    hl->capacity = capacity;
+    if (count > 0)
+        memcpy(hl->h, old->h, (size_t)count * sizeof hl->h[0]);
+    return hl;
+}
+
+// Publishes hl as e's holder list and retires the one it replaces
+static void holder_list_swap(struct catalog_entry *e, struct holder_list *hl) {
+    struct holder_list *old = e->holders;
+    __atomic_store_n(&e->holders, hl, __ATOMIC_RELEASE);
+    epoch_retire(old);
+}
+
+// Index of socket_fd in hl, or -1
+static int holder_index(const struct holder_list *hl, int socket_fd) {
+    for (uint32_t i = 0; hl != NULL && i < hl->count; i++) {
+        if (hl->h[i].socket_fd == socket_fd)
+            return i;
+    }
+    return -1;
+}
+
+struct catalog_entry *catalog_add_holder(struct catalog *cat, const char *name, const struct holder *h) {
+    uint64_t hash = catalog_hash(name);
+    struct catalog_entry *e = catalog_probe(cat, cat->table, hash & cat->table->mask, hash, name);
+    if (e == NULL && (e = catalog_intern(cat, name, hash)) == NULL)
+        return NULL;
+
+    // a peer is only listed once per file
+    struct holder_list *hl = e->holders;
+    if (holder_index(hl, h->socket_fd) != -1)
+        return e;
+
+    if (hl != NULL && hl->count < hl->capacity) {
+        // readers only look at the first count records, so the new one can
+        // be written in place and then counted
+        hl->h[hl->count] = *h;
+        __atomic_store_n(&hl->count, hl->count + 1, __ATOMIC_RELEASE);
+        return e;
+    }
+    uint32_t count = hl != NULL ? hl->count : 0;
+    struct holder_list *grown = holder_list_copy(hl, count, count ? count * 2 : 2);
+    if (grown == NULL)
+        return NULL;
+    grown->h[grown->count++] = *h;
+    holder_list_swap(e, grown);
+    return e;
+}
+
+void catalog_remove_holder(struct catalog_entry *e, int socket_fd) {
+    struct holder_list *hl = e->holders;
+    int i = holder_index(hl, socket_fd);
+    if (i == -1)
+        return;
+
+    // the name stays interned, but an unheld name doesn't keep a list
+    __atomic_store_n(&hl->h[i].socket_fd, HOLDER_NONE, __ATOMIC_RELEASE);
+    if (holder_list_first(hl) == NULL) {
+        holder_list_swap(e, NULL);
+        return;
+    }
+    // keep holders in publish order so SEARCH answers with the oldest holder.
+    // Readers may be walking hl, so the shorter list is a copy, which also
+    // drops any records blanked earlier.
+    struct holder_list *shrunk = holder_list_copy(hl, 0, hl->capacity);
+    if (shrunk == NULL) {
+        // out of memory: the record stays blanked in place. Readers skip
+        // blanks, and a list of nothing but blanks was dropped above, so a
+        // held name still means a non-empty list.
+        return;
+    }
+    for (uint32_t j = 0; j < hl->count; j++) {
+        if (hl->h[j].socket_fd != HOLDER_NONE)
+            shrunk->h[shrunk->count++] = hl->h[j];
+    }
+    holder_list_swap(e, shrunk);
+}
+
+void catalog_update_holder(struct catalog_entry *e, int socket_fd, const struct holder *h) {
+    struct holder_list *hl = e->holders;
+    int i = holder_index(hl, socket_fd);
+    if (i == -1)
+        return;
+    struct holder_list *updated = holder_list_copy(hl, hl->count, hl->capacity);
+    if (updated == NULL)
+        return;
+    updated->h[i] = *h;
+    holder_list_swap(e, updated);
+}
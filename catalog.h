@@ -0,0 +1,113 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+#define CATALOG_NONE 0xFFFFFFFFu        // "no entry" id
+#define CATALOG_CHUNK_SHIFT 12          // entries per chunk: 4096
+#define CATALOG_MAX_CHUNKS 65536
+
+#define HOLDER_NONE -1                  // socket_fd of "no holder"
+
+// What SEARCH needs to know about one peer holding a file, copied out of
+// the peer entry so readers never touch peer entries. ip and port are in
+// network byte order. socket_fd identifies the peer: it is negative (but
+// not HOLDER_NONE) for peers restored from a snapshot that haven't
+// reconnected yet.
+struct holder {
+    int socket_fd;
+    uint32_t peer_id;
+    uint32_t ip;
+    uint16_t port;
+};
+
+// The peers holding a file, oldest publish first. Readers see either the
+// old or the new list: writers append in place by filling h[count] before
+// publishing count+1, and replace the whole list to remove or rewrite a
+// holder.
+struct holder_list {
+    uint32_t count;
+    uint32_t capacity;
+    struct holder h[];
+};
+
+// One distinct filename and the peers that published it. Every name is
+// interned: it is stored once in the catalog's arena and gets a compact id
+// that peers' file lists use instead of a copy of the name. Entries are
+// never freed, so ids and entry pointers stay valid, and everything but
+// holders is immutable once the entry is published.
+struct catalog_entry {
+    const char *name;               // in the catalog's arena
+    uint64_t hash;
+    struct holder_list *holders;    // NULL when nobody holds it
+    uint32_t id;
+};
+
+// Open-addressing hash table of entry ids, replaced wholesale when it grows
+struct catalog_table {
+    uint32_t mask;                  // slot count - 1, a power of two minus one
+    uint32_t slots[];               // CATALOG_NONE when empty
+};
+
+// Ids in name order, immutable once published
+struct catalog_run {
+    uint32_t count;
+    uint32_t ids[];
+};
+
+// Hash index from filename to catalog_entry. Lookups (catalog_find*,
+// catalog_*_search, catalog_holders) are safe without a lock inside an
+// epoch_enter()/epoch_exit() section; everything else needs the caller's
+// write lock. Entries live in fixed-size chunks indexed by id.
+struct catalog {
+    struct catalog_table *table;
+    uint32_t entry_count;           // also the next id to hand out
+    struct catalog_entry **chunks;  // CATALOG_MAX_CHUNKS slots
+    struct arena names;
+
+    // Every id sorted by name, for prefix queries, kept in two runs: recent
+    // takes each new name and is folded into sorted once it fills up. Both
+    // are replaced wholesale and retired, so readers just merge the pair.
+    struct catalog_run *sorted;     // NULL when empty
+    struct catalog_run *recent;     // NULL when empty
+};
+
+int catalog_init(struct catalog *cat);
+void catalog_free(struct catalog *cat);
+
+uint64_t catalog_hash(const char *name);
+
+// Returns the entry with the given id, or NULL
+struct catalog_entry *catalog_entry_by_id(const struct catalog *cat, uint32_t id);
+// Returns the entry's current holder list, or NULL if nobody holds it
+const struct holder_list *catalog_holders(const struct catalog_entry *e);
+// Number of records in a holder list (0 for NULL); only those may be read
+uint32_t holder_list_count(const struct holder_list *hl);
+// The oldest record that isn't blank (HOLDER_NONE), or NULL. Readers must
+// skip blank records wherever they look at more than the count.
+const struct holder *holder_list_first(const struct holder_list *hl);
+// Returns the entry for name, or NULL if the name was never published
+struct catalog_entry *catalog_find(const struct catalog *cat, const char *name);
+// Looks up n names at once, storing each entry (or NULL) in out[]. Hashing
+// and slot loads for the whole batch are issued before any name is
+// compared, so the cache misses overlap instead of being paid one by one.
+void catalog_find_batch(const struct catalog *cat, const char *const *names, int n, struct catalog_entry **out);
+// Fills out[] with the ids of up to limit held names starting with prefix,
+// in name order, skipping names up to and including after. Returns how many
+// were found.
+int catalog_prefix_search(const struct catalog *cat, const char *prefix, const char *after, int limit, uint32_t *out);
+// Same for names containing pattern, in id order after the name after
+int catalog_substring_search(const struct catalog *cat, const char *pattern, const char *after, int limit, uint32_t *out);
+
+// Records that a peer has name, interning the name if it is new. Returns the
+// entry, or NULL if out of memory.
+struct catalog_entry *catalog_add_holder(struct catalog *cat, const char *name, const struct holder *h);
+// Forgets that the peer on socket_fd has the entry. The name stays interned.
+void catalog_remove_holder(struct catalog_entry *e, int socket_fd);
+// Replaces the holder record for socket_fd with h in place, e.g. after the
+// peer re-joins
+void catalog_update_holder(struct catalog_entry *e, int socket_fd, const struct holder *h);
+
+#endif
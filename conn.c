@@ -0,0 +1,199 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "conn.h"
+
+#define CONN_TABLE_MIN 64
+#define CONN_IN_MIN 4096
+#define CONN_MAX_IOV 64
+
+void conn_table_init(struct conn_table *t) {
+    t->slots = NULL;
+    t->capacity = 0;
+    t->count = 0;
+}
+
+void conn_table_free(struct conn_table *t) {
+    for (int i = 0; i < t->capacity; i++) {
+        if (t->slots[i] != NULL)
+            conn_release(t, i);
+    }
+    free(t->slots);
+    conn_table_init(t);
+}
+
+// Makes sure slots[fd] exists, doubling the table as needed
+static int conn_table_reserve(struct conn_table *t, int fd) {
+    if (fd < t->capacity)
+        return 0;
+
+    int capacity = t->capacity ? t->capacity : CONN_TABLE_MIN;
+    while (capacity <= fd)
+        capacity *= 2;
+
+    struct conn **slots = realloc(t->slots, capacity * sizeof *slots);
+    if (slots == NULL)
+        return -1;
+    memset(slots + t->capacity, 0, (capacity - t->capacity) * sizeof *slots);
+    t->slots = slots;
+    t->capacity = capacity;
+    return 0;
+}
+
+struct conn *conn_open(struct conn_table *t, int fd, const struct sockaddr_storage *addr, socklen_t addrlen) {
+    if (fd < 0 || conn_table_reserve(t, fd) == -1)
+        return NULL;
+
+    struct conn *c = t->slots[fd];
+    if (c == NULL) {
+        c = calloc(1, sizeof *c);
+        if (c == NULL)
+            return NULL;
+        t->slots[fd] = c;
+        t->count++;
+    }
+    c->fd = fd;
+    c->events = 0;
+    c->reading_paused = 0;
+    c->detached = 0;
+    c->recv_armed = 0;
+    c->send_inflight = 0;
+    c->closing = 0;
+    c->uring_id = 0;
+    c->last_active = 0;
+    c->partial_since = 0;
+    c->data = NULL;
+    c->in_start = c->in_end = 0;
+    c->scan.offset = 0;
+    c->scan.names = 0;
+    memcpy(&c->addr, addr, sizeof c->addr);
+    c->addrlen = addrlen;
+    return c;
+}
+
+struct conn *conn_find(const struct conn_table *t, int fd) {
+    if (fd < 0 || fd >= t->capacity)
+        return NULL;
+    return t->slots[fd];
+}
+
+void conn_release(struct conn_table *t, int fd) {
+    struct conn *c = conn_find(t, fd);
+    if (c == NULL)
+        return;
+    free(c->in_buf);
+    while (c->out_head != NULL) {
+        struct out_chunk *next = c->out_head->next;
+        free(c->out_head);
+        c->out_head = next;
+    }
+    free(c);
+    t->slots[fd] = NULL;
+    t->count--;
+}
+
+unsigned char *conn_in_reserve(struct conn *c, size_t min_free, size_t max_size, size_t *avail) {
+    size_t used = c->in_end - c->in_start;
+    if (c->in_capacity - c->in_end < min_free && c->in_start > 0) {
+        // slide the partial request to the front
+        memmove(c->in_buf, c->in_buf + c->in_start, used);
+        c->in_start = 0;
+        c->in_end = used;
+    }
+    if (c->in_capacity - c->in_end < min_free) {
+        size_t capacity = c->in_capacity ? c->in_capacity : CONN_IN_MIN;
+        while (capacity - used < min_free)
+            capacity *= 2;
+        if (capacity > max_size)
+            capacity = max_size;
+        if (capacity <= c->in_capacity || capacity - used < min_free)
+            return NULL;
+        unsigned char *buf = realloc(c->in_buf, capacity);
+        if (buf == NULL)
+            return NULL;
+        c->in_buf = buf;
+        c->in_capacity = capacity;
+    }
+    *avail = c->in_capacity - c->in_end;
+    return c->in_buf + c->in_end;
+}
+
+void conn_in_consume(struct conn *c, size_t len) {
+    c->in_start += len;
+    c->scan.offset = 0;
+    c->scan.names = 0;
+    if (c->in_start == c->in_end)
+        c->in_start = c->in_end = 0;
+}
+
+int conn_queue(struct conn *c, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        struct out_chunk *tail = c->out_tail;
+        if (tail == NULL || tail->end == OUT_CHUNK_SIZE) {
+            tail = malloc(sizeof *tail);
+            if (tail == NULL)
+                return -1;
+            tail->next = NULL;
+            tail->start = tail->end = 0;
+            if (c->out_tail != NULL)
+                c->out_tail->next = tail;
+            else
+                c->out_head = tail;
+            c->out_tail = tail;
+        }
+
+        size_t n = OUT_CHUNK_SIZE - tail->end;
+        if (n > len)
+            n = len;
+        memcpy(tail->data + tail->end, p, n);
+        tail->end += n;
+        c->out_bytes += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int conn_flush(struct conn *c) {
+    while (c->out_head != NULL) {
+        // one writev() covers every queued chunk, up to CONN_MAX_IOV
+        struct iovec iov[CONN_MAX_IOV];
+        int iovcnt = 0;
+        for (struct out_chunk *ch = c->out_head; ch != NULL && iovcnt < CONN_MAX_IOV; ch = ch->next) {
+            iov[iovcnt].iov_base = ch->data + ch->start;
+            iov[iovcnt].iov_len = ch->end - ch->start;
+            iovcnt++;
+        }
+
+        ssize_t sent = writev(c->fd, iov, iovcnt);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        conn_out_consume(c, sent);
+    }
+    return 0;
+}
+
+void conn_out_consume(struct conn *c, size_t len) {
+    c->out_bytes -= len;
+    while (len > 0) {
+        struct out_chunk *ch = c->out_head;
+        size_t left = ch->end - ch->start;
+        if (len < left) {
+            ch->start += len;
+            break;
+        }
+        len -= left;
+        c->out_head = ch->next;
+        if (c->out_head == NULL)
+            c->out_tail = NULL;
+        free(ch);
+    }
+}
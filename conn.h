@@ -0,0 +1,81 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "protocol.h"
+#include "timer.h"
+
+#define OUT_CHUNK_SIZE 16384
+
+// A block of queued response bytes; data[start, end) has not been sent yet
+struct out_chunk {
+    struct out_chunk *next;
+    size_t start;
+    size_t end;
+    unsigned char data[OUT_CHUNK_SIZE];
+};
+
+// Per-connection state kept by the event loop, one per accepted socket.
+// Bytes read but not yet decoded into whole requests live in
+// in_buf[in_start, in_end). Responses are queued in out_head..out_tail and
+// written with writev() whenever the socket is writable, or by io_uring sends
+// of out_head one at a time.
+struct conn {
+    int fd;
+    struct sockaddr_storage addr;   // address returned by accept()
+    socklen_t addrlen;
+    int events;                     // REACTOR_* events currently watched
+    int reading_paused;             // set while out_bytes is over the high-water mark
+    int detached;                   // handed to another thread; the event loop lets go
+    int recv_armed;                 // io_uring: a multishot recv is in flight
+    int send_inflight;              // io_uring: a send of out_head is in flight
+    int closing;                    // io_uring: closed, waiting for those two to finish
+    uint32_t uring_id;              // io_uring: tags the socket's requests
+    struct timer timer;             // idle and request timeouts
+    uint64_t last_active;           // ns, when bytes last arrived
+    uint64_t partial_since;         // ns, since when a request has been incomplete; 0 if none
+    void *data;                     // the table owner's own state, not freed here
+    struct frame_scan scan;         // decoding progress of the request at in_start
+    unsigned char *in_buf;
+    size_t in_start;
+    size_t in_end;
+    size_t in_capacity;
+    struct out_chunk *out_head;
+    struct out_chunk *out_tail;
+    size_t out_bytes;
+};
+
+// Connections indexed directly by socket fd; grows on demand
+struct conn_table {
+    struct conn **slots;
+    int capacity;
+    int count;
+};
+
+void conn_table_init(struct conn_table *t);
+void conn_table_free(struct conn_table *t);
+
+// Allocates the connection for fd, returns NULL if out of memory
+struct conn *conn_open(struct conn_table *t, int fd, const struct sockaddr_storage *addr, socklen_t addrlen);
+// Returns the connection for fd or NULL
+struct conn *conn_find(const struct conn_table *t, int fd);
+// Returns room for at least min_free more input bytes at in_buf + in_end,
+// compacting or growing the buffer. *avail is set to the space available.
+// Returns NULL if the buffer can't grow past max_size or out of memory.
+unsigned char *conn_in_reserve(struct conn *c, size_t min_free, size_t max_size, size_t *avail);
+// Marks len decoded bytes at in_buf + in_start as consumed, which starts
+// the next request's scan afresh
+void conn_in_consume(struct conn *c, size_t len);
+// Appends len bytes to the output queue; -1 if out of memory
+int conn_queue(struct conn *c, const void *data, size_t len);
+// Writes as much queued output as the socket takes. Returns 0 when the queue
+// is empty or the socket would block, -1 on a socket error.
+int conn_flush(struct conn *c);
+// Drops len sent bytes from the front of the output queue
+void conn_out_consume(struct conn *c, size_t len);
+// Frees the connection state for fd, the caller closes the socket
+void conn_release(struct conn_table *t, int fd);
+
+#endif
@@ -0,0 +1,109 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "epoch.h"
+
+#define EPOCH_ACTIVE 1  // low bit of a thread's state while it reads
+
+// A thread's state is 0 when idle, or (epoch << 1) | EPOCH_ACTIVE while
+// reading. Each slot has its own cache line so readers don't share one.
+struct epoch_thread {
+    uint64_t state;
+    char pad[64 - sizeof(uint64_t)];
+};
+
+// Memory waiting for the readers of its epoch to finish
+struct limbo {
+    struct limbo *next;
+    uint64_t epoch;
+    void *p;
+};
+
+static uint64_t global_epoch = 1;
+static struct epoch_thread threads[EPOCH_MAX_THREADS];
+static int thread_count;
+static struct limbo *limbo_head;
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct epoch_thread *self;
+
+// Hands the calling thread a slot the first time it reads
+static struct epoch_thread *epoch_self(void) {
+    if (self == NULL) {
+        pthread_mutex_lock(&epoch_lock);
+        if (thread_count == EPOCH_MAX_THREADS)
+            abort();
+        self = &threads[thread_count];
+        __atomic_store_n(&thread_count, thread_count + 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&epoch_lock);
+    }
+    return self;
+}
+
+void epoch_enter(void) {
+    struct epoch_thread *t = epoch_self();
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&t->state, (epoch << 1) | EPOCH_ACTIVE, __ATOMIC_RELAXED);
+    // the announcement must be visible before any shared pointer is loaded
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+}
+
+// Moves the global epoch forward if every active reader has seen it.
+// Called with epoch_lock held.
+static void epoch_try_advance(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t epoch = global_epoch;
+    int n = __atomic_load_n(&thread_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        uint64_t state = __atomic_load_n(&threads[i].state, __ATOMIC_ACQUIRE);
+        if ((state & EPOCH_ACTIVE) && (state >> 1) != epoch)
+            return;
+    }
+    __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_RELEASE);
+}
+
+void epoch_retire(void *p) {
+    if (p == NULL)
+        return;
+    struct limbo *l = malloc(sizeof *l);
+    pthread_mutex_lock(&epoch_lock);
+    if (l == NULL) {
+        // nowhere to park it; leaking is safer than freeing under a reader
+        pthread_mutex_unlock(&epoch_lock);
+        return;
+    }
+    l->epoch = global_epoch;
+    l->p = p;
+    l->next = limbo_head;
+    limbo_head = l;
+    pthread_mutex_unlock(&epoch_lock);
+}
+
+void epoch_collect(void) {
+    pthread_mutex_lock(&epoch_lock);
+    if (limbo_head == NULL) {
+        pthread_mutex_unlock(&epoch_lock);
+        return;
+    }
+    epoch_try_advance();
+
+    // anything retired two epochs ago can't be reachable by a reader. The
+    // list is newest first, so that is everything past the first old node.
+    uint64_t safe = global_epoch;
+    struct limbo **link = &limbo_head;
+    while (*link != NULL && (*link)->epoch + 2 > safe)
+        link = &(*link)->next;
+    struct limbo *done = *link;
+    *link = NULL;
+    pthread_mutex_unlock(&epoch_lock);
+
+    while (done != NULL) {
+        struct limbo *next = done->next;
+        free(done->p);
+        free(done);
+        done = next;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation for the registry's read path.
+ *
+ * SEARCH-side readers bracket their lookups with epoch_enter()/epoch_exit().
+ * Those are a plain store plus a fence: no locks and no atomic
+ * read-modify-write. Writers (already serialized by the registry's write
+ * lock) publish new versions of shared data with release stores and hand
+ * the old version to epoch_retire(). Retired memory is freed once every
+ * thread that was reading has left its critical section.
+ */
+
+#define EPOCH_MAX_THREADS 512
+
+// Marks the calling thread as reading shared data; may not nest
+void epoch_enter(void);
+void epoch_exit(void);
+
+// Frees p with free() once no reader can still hold a reference to it
+void epoch_retire(void *p);
+
+// Frees whatever has become safe to free; called by writers
+void epoch_collect(void);
+
+#endif
@@ -0,0 +1,577 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "conn.h"
+#include "fetch_server.h"
+#include "protocol.h"
+#include "reactor.h"
+
+#define MAX_EVENTS 64
+#define POOL_THREADS 4
+#define READ_WINDOW (1 << 20)       // bytes read ahead per pool job
+#define READ_AHEAD (2 * READ_WINDOW)    // how far reading runs ahead of sending
+#define MAX_REQUEST 4096
+#define HASH_CACHE_BYTES (16 << 20) // chunk hashes kept for files asked about again
+
+enum job { JOB_NONE, JOB_READ, JOB_HASH };
+
+// Chunk hashes of a shared file, kept until the file changes or the cache
+// needs the room
+struct hash_entry {
+    struct hash_entry *next;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint32_t count;
+    uint64_t hashes[];
+};
+
+// The request a connection is working on. While the pool runs a job for
+// it the pool owns it: a connection closed meanwhile only marks it
+// orphaned, and the loop frees it once the job comes back.
+struct transfer {
+    struct transfer *next;      // in the pool's queue or its finished list
+    int sock;
+    int file;                   // file of the current request, -1 if none
+    struct stat st;
+    off_t offset;               // next byte to send
+    off_t end;
+    off_t cached;               // bytes before this have been read ahead
+    off_t read_end;             // where the running JOB_READ stops
+    enum job job;
+    struct hash_entry *hashes;  // result of a JOB_HASH
+    int blocked;                // the socket took no more file data
+    int close_after;            // close once everything queued is sent
+    int orphaned;
+};
+
+struct fetch_server {
+    int listen_socket;
+    int wake_fd;                // the pool signals finished jobs on this eventfd
+    struct reactor reactor;
+    struct conn_table conns;
+    pthread_mutex_t lock;       // guards the three lists below
+    pthread_cond_t work;
+    struct transfer *jobs;
+    struct transfer **jobs_tail;
+    struct transfer *finished;
+    // only the loop thread touches the cache, so an entry it looks up
+    // can't be freed before it has been queued
+    struct hash_entry *hash_cache;  // most recently used first
+    size_t hash_cache_bytes;
+};
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// 8 bytes at a time through a multiply-rotate mix
+uint64_t chunk_hash(const unsigned char *p, size_t len) {
+    const uint64_t p1 = 0x9E3779B185EBCA87ULL, p2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t h = 0x27D4EB2F165667C5ULL ^ (len * p1);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        h ^= rotl64(le64toh(word) * p2, 31) * p1;
+        h = rotl64(h, 27) * p1 + p2;
+    }
+    for (; i < len; i++) {
+        h ^= p[i] * p1;
+        h = rotl64(h, 11) * p2;
+    }
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    return h;
+}
+
+static size_t hash_entry_size(const struct hash_entry *e) {
+    return sizeof *e + (size_t)e->count * sizeof e->hashes[0];
+}
+
+// Looks the file up in the cache and moves it to the front
+static struct hash_entry *cached_hashes(struct fetch_server *srv, const struct stat *st) {
+    for (struct hash_entry **link = &srv->hash_cache; *link != NULL; link = &(*link)->next) {
+        struct hash_entry *e = *link;
+        if (e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+            e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            *link = e->next;
+            e->next = srv->hash_cache;
+            srv->hash_cache = e;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Adds a freshly hashed file to the front of the cache. Older hashes of
+// the same file are stale and go, then the least recently used entries
+// until the cache fits again; e itself always stays.
+static void cache_hashes(struct fetch_server *srv, struct hash_entry *e) {
+    struct hash_entry **link = &srv->hash_cache;
+    while (*link != NULL) {
+        struct hash_entry *old = *link;
+        if (old->dev == e->dev && old->ino == e->ino) {
+            *link = old->next;
+            srv->hash_cache_bytes -= hash_entry_size(old);
+            free(old);
+        } else {
+            link = &old->next;
+        }
+    }
+    e->next = srv->hash_cache;
+    srv->hash_cache = e;
+    srv->hash_cache_bytes += hash_entry_size(e);
+
+    while (srv->hash_cache_bytes > HASH_CACHE_BYTES && e->next != NULL) {
+        link = &e->next;
+        while ((*link)->next != NULL)
+            link = &(*link)->next;
+        srv->hash_cache_bytes -= hash_entry_size(*link);
+        free(*link);
+        *link = NULL;
+    }
+}
+
+// Hashes the file on a pool thread; the loop caches the result
+static struct hash_entry *hash_file(int fd, const struct stat *st) {
+    uint32_t count = (st->st_size + FETCH_CHUNK - 1) / FETCH_CHUNK;
+    struct hash_entry *e = malloc(sizeof *e + (size_t)count * sizeof e->hashes[0]);
+    unsigned char *chunk = malloc(FETCH_CHUNK);
+    if (e == NULL || chunk == NULL) {
+        free(e);
+        free(chunk);
+        return NULL;
+    }
+    e->next = NULL;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->count = count;
+    for (uint32_t i = 0; i < count; i++) {
+        off_t offset = (off_t)i * FETCH_CHUNK;
+        size_t len = st->st_size - offset < FETCH_CHUNK ? st->st_size - offset : FETCH_CHUNK;
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = pread(fd, chunk + got, len - got, offset + got);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                // changed under us; the next request hashes it again
+                free(e);
+                free(chunk);
+                return NULL;
+            }
+            got += n;
+        }
+        e->hashes[i] = chunk_hash(chunk, len);
+    }
+    free(chunk);
+    return e;
+}
+
+// Brings [offset, end) of the file into the page cache by reading it into
+// the pool thread's scratch buffer, at most READ_WINDOW bytes: one pread()
+// that returns once the data is in. pread() rather than a mapping, so a
+// file cut short meanwhile is harmless.
+static void read_window(int fd, off_t offset, off_t end, unsigned char *scratch) {
+    while (offset < end) {
+        ssize_t n = pread(fd, scratch, end - offset, offset);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        offset += n;
+    }
+}
+
+static void *pool_run(void *arg) {
+    struct fetch_server *srv = arg;
+    unsigned char *scratch = malloc(READ_WINDOW);
+    while (1) {
+        pthread_mutex_lock(&srv->lock);
+        while (srv->jobs == NULL)
+            pthread_cond_wait(&srv->work, &srv->lock);
+        struct transfer *t = srv->jobs;
+        srv->jobs = t->next;
+        if (srv->jobs == NULL)
+            srv->jobs_tail = &srv->jobs;
+        pthread_mutex_unlock(&srv->lock);
+
+        if (t->job == JOB_HASH)
+            t->hashes = hash_file(t->file, &t->st);
+        else if (scratch != NULL)
+            read_window(t->file, t->cached, t->read_end, scratch);
+
+        pthread_mutex_lock(&srv->lock);
+        t->next = srv->finished;
+        srv->finished = t;
+        pthread_mutex_unlock(&srv->lock);
+        uint64_t one = 1;
+        if (write(srv->wake_fd, &one, sizeof one) == -1)
+            perror("ERROR waking FETCH server");
+    }
+    return NULL;
+}
+
+static void submit(struct fetch_server *srv, struct transfer *t, enum job job) {
+    t->job = job;
+    t->next = NULL;
+    pthread_mutex_lock(&srv->lock);
+    *srv->jobs_tail = t;
+    srv->jobs_tail = &t->next;
+    pthread_cond_signal(&srv->work);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+// Opens a plain file directly in SharedFiles, or returns -1
+static int open_shared(const char *name, struct stat *st) {
+    if (name[0] == '\0' || strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return -1;
+    char path[MAX_FILENAME_LEN + 16];
+    snprintf(path, sizeof path, "SharedFiles/%s", name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1 && (fstat(fd, st) == -1 || !S_ISREG(st->st_mode))) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Looks for one complete request at the start of buf, like frame_decode()
+static int peer_frame(const unsigned char *buf, size_t len, size_t *frame_len) {
+    size_t name_at;
+    switch (buf[0]) {
+    case FETCH:
+    case FETCH_HASHES:
+        name_at = 1;
+        break;
+    case FETCH_RANGE:
+        name_at = 17;
+        break;
+    default:
+        return FRAME_ERROR;
+    }
+    if (len <= name_at)
+        return FRAME_PARTIAL;
+    const unsigned char *nul = memchr(buf + name_at, '\0', len - name_at);
+    if (nul == NULL)
+        return len - name_at >= MAX_FILENAME_LEN ? FRAME_ERROR : FRAME_PARTIAL;
+    *frame_len = nul - buf + 1;
+    return FRAME_OK;
+}
+
+static void queue_hashes(struct conn *c, const struct hash_entry *e) {
+    unsigned char header[HASHES_HEADER_LEN];
+    memset(header, 0, sizeof header);
+    if (e == NULL) {
+        header[0] = 1;
+        conn_queue(c, header, sizeof header);
+        return;
+    }
+    put_u64(header + 1, e->size);
+    uint32_t net_chunk_size = htonl(FETCH_CHUNK);
+    uint32_t net_count = htonl(e->count);
+    memcpy(header + 9, &net_chunk_size, 4);
+    memcpy(header + 13, &net_count, 4);
+    conn_queue(c, header, sizeof header);
+    for (uint32_t i = 0; i < e->count; i++) {
+        unsigned char hash[8];
+        put_u64(hash, e->hashes[i]);
+        conn_queue(c, hash, sizeof hash);
+    }
+}
+
+// Answers one request: queues the response header and, for file data,
+// sets the transfer up for send_file()
+static void handle_request(struct fetch_server *srv, struct conn *c, const unsigned char *frame) {
+    struct transfer *t = c->data;
+    unsigned char op = frame[0];
+    const char *name = (const char *)frame + (op == FETCH_RANGE ? 17 : 1);
+    int fd = open_shared(name, &t->st);
+    off_t size = fd == -1 ? 0 : t->st.st_size;
+
+    if (op == FETCH) {
+        unsigned char code = fd == -1 ? 1 : 0;
+        conn_queue(c, &code, 1);
+        t->offset = 0;
+        t->end = size;
+        t->close_after = 1;
+    } else if (op == FETCH_RANGE) {
+        uint64_t offset = get_u64(frame + 1);
+        uint64_t length = get_u64(frame + 9);
+        unsigned char header[RANGE_HEADER_LEN];
+        header[0] = fd == -1 ? 1 : 0;
+        put_u64(header + 1, size);
+        conn_queue(c, header, sizeof header);
+        t->offset = offset < (uint64_t)size ? (off_t)offset : size;
+        t->end = (uint64_t)(size - t->offset) < length ? size : t->offset + (off_t)length;
+    } else {
+        struct hash_entry *e = fd == -1 ? NULL : cached_hashes(srv, &t->st);
+        if (fd != -1 && e == NULL) {
+            t->file = fd;
+            submit(srv, t, JOB_HASH);
+            return;
+        }
+        queue_hashes(c, e);
+        t->end = t->offset = 0;
+    }
+
+    if (fd != -1 && t->offset < t->end) {
+        t->file = fd;
+        t->cached = t->offset;
+    } else if (fd != -1) {
+        close(fd);
+    }
+}
+
+// Handles the complete requests in the input buffer, stopping at the first
+// one that has file data to send or a job to wait for
+static void process_requests(struct fetch_server *srv, struct conn *c) {
+    struct transfer *t = c->data;
+    while (t->file == -1 && !t->close_after && c->in_start < c->in_end) {
+        size_t frame_len;
+        unsigned char *frame = c->in_buf + c->in_start;
+        int rc = peer_frame(frame, c->in_end - c->in_start, &frame_len);
+        if (rc == FRAME_PARTIAL)
+            return;
+        if (rc == FRAME_ERROR) {
+            fprintf(stderr, "Error receiving command operation (%d), expecting FETCH\n", frame[0]);
+            conn_in_consume(c, c->in_end - c->in_start);
+            t->close_after = 1;
+            return;
+        }
+        handle_request(srv, c, frame);
+        conn_in_consume(c, frame_len);
+    }
+}
+
+// Sends file data up to what has been read ahead, and keeps the pool
+// reading ahead of it. Returns 1 after progress, 0 when it has to wait for
+// the socket or the pool, -1 on a socket error.
+static int send_file(struct fetch_server *srv, struct transfer *t) {
+    if (t->job == JOB_HASH)
+        return 0;
+    if (t->offset == t->end) {
+        close(t->file);
+        t->file = -1;
+        return 1;
+    }
+    if (t->job == JOB_NONE && t->cached < t->end && t->cached - t->offset < READ_AHEAD) {
+        t->read_end = t->cached + READ_WINDOW < t->end ? t->cached + READ_WINDOW : t->end;
+        submit(srv, t, JOB_READ);
+    }
+    if (t->offset == t->cached)
+        return 0;
+
+    ssize_t n = sendfile(t->sock, t->file, &t->offset, t->cached - t->offset);
+    if (n > 0 || (n == -1 && errno == EINTR))
+        return 1;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        t->blocked = 1;
+        return 0;
+    }
+    return -1;
+}
+
+static void close_peer(struct fetch_server *srv, struct conn *c) {
+    struct transfer *t = c->data;
+    int s = c->fd;
+    if (t->job != JOB_NONE) {
+        t->orphaned = 1;
+    } else {
+        if (t->file != -1)
+            close(t->file);
+        free(t);
+    }
+    reactor_del(&srv->reactor, s);
+    conn_release(&srv->conns, s);
+    close(s);
+}
+
+// Moves a connection along as far as it goes without waiting: answers its
+// requests, sends, and reads more requests whenever it is idle. Reading
+// only when idle keeps a peer from queueing up more than one request's
+// worth of work. The connection may be closed on return.
+static void serve(struct fetch_server *srv, struct conn *c) {
+    struct transfer *t = c->data;
+    t->blocked = 0;
+    while (1) {
+        process_requests(srv, c);
+        if (conn_flush(c) == -1)
+            goto fail;
+        if (c->out_bytes > 0)
+            break;
+        if (t->file != -1) {
+            int rc = send_file(srv, t);
+            if (rc == -1)
+                goto fail;
+            if (rc == 0)
+                break;
+            continue;
+        }
+        if (t->close_after)
+            goto fail;
+
+        size_t avail;
+        unsigned char *space = conn_in_reserve(c, 1, MAX_REQUEST, &avail);
+        if (space == NULL)
+            goto fail;
+        ssize_t n = recv(c->fd, space, avail, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            goto fail;
+        c->in_end += n;
+    }
+
+    int want = REACTOR_READ | (c->out_bytes > 0 || t->blocked ? REACTOR_WRITE : 0);
+    if (want != c->events && reactor_mod(&srv->reactor, c->fd, want) == 0)
+        c->events = want;
+    return;
+fail:
+    close_peer(srv, c);
+}
+
+static void accept_peers(struct fetch_server *srv) {
+    while (1) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof addr;
+        int s = accept(srv->listen_socket, (struct sockaddr *)&addr, &addrlen);
+        if (s == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Error accepting FETCH connection");
+            return;
+        }
+
+        struct transfer *t = calloc(1, sizeof *t);
+        struct conn *c = NULL;
+        if (t == NULL || set_nonblocking(s) == -1 ||
+            (c = conn_open(&srv->conns, s, &addr, addrlen)) == NULL) {
+            free(t);
+            close(s);
+            continue;
+        }
+        if (reactor_add(&srv->reactor, s, REACTOR_READ) == -1) {
+            free(t);
+            conn_release(&srv->conns, s);
+            close(s);
+            continue;
+        }
+        t->sock = s;
+        t->file = -1;
+        c->data = t;
+        c->events = REACTOR_READ;
+    }
+}
+
+// Picks up the jobs the pool has finished and carries on with their
+// connections
+static void finish_jobs(struct fetch_server *srv) {
+    uint64_t count;
+    if (read(srv->wake_fd, &count, sizeof count) == -1 && errno != EAGAIN)
+        perror("Error reading FETCH server wakeups");
+
+    pthread_mutex_lock(&srv->lock);
+    struct transfer *list = srv->finished;
+    srv->finished = NULL;
+    pthread_mutex_unlock(&srv->lock);
+
+    while (list != NULL) {
+        struct transfer *t = list;
+        list = t->next;
+        enum job job = t->job;
+        t->job = JOB_NONE;
+        if (job == JOB_HASH && t->hashes != NULL)
+            cache_hashes(srv, t->hashes);
+        if (t->orphaned) {
+            close(t->file);
+            free(t);
+            continue;
+        }
+
+        struct conn *c = conn_find(&srv->conns, t->sock);
+        if (job == JOB_HASH) {
+            queue_hashes(c, t->hashes);
+            close(t->file);
+            t->file = -1;
+        } else {
+            t->cached = t->read_end;
+        }
+        serve(srv, c);
+    }
+}
+
+static void *server_run(void *arg) {
+    struct fetch_server *srv = arg;
+    struct reactor_event events[MAX_EVENTS];
+    while (1) {
+        int n = reactor_wait(&srv->reactor, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error waiting for FETCH connections");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int s = events[i].fd;
+            if (s == srv->listen_socket) {
+                accept_peers(srv);
+            } else if (s == srv->wake_fd) {
+                finish_jobs(srv);
+            } else {
+                struct conn *c = conn_find(&srv->conns, s);
+                if (c != NULL)
+                    serve(srv, c);
+            }
+        }
+    }
+    return NULL;
+}
+
+int fetch_server_start(int listen_socket) {
+    struct fetch_server *srv = calloc(1, sizeof *srv);
+    if (srv == NULL)
+        return -1;
+    srv->listen_socket = listen_socket;
+    srv->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    srv->jobs_tail = &srv->jobs;
+    pthread_mutex_init(&srv->lock, NULL);
+    pthread_cond_init(&srv->work, NULL);
+    conn_table_init(&srv->conns);
+    if (srv->wake_fd == -1 || reactor_init(&srv->reactor) == -1 ||
+        set_nonblocking(listen_socket) == -1 ||
+        reactor_add(&srv->reactor, listen_socket, REACTOR_READ) == -1 ||
+        reactor_add(&srv->reactor, srv->wake_fd, REACTOR_READ) == -1) {
+        perror("Error setting up FETCH server");
+        return -1;
+    }
+
+    pthread_t thread;
+    for (int i = 0; i < POOL_THREADS; i++) {
+        if (pthread_create(&thread, NULL, pool_run, srv) != 0)
+            return -1;
+        pthread_detach(thread);
+    }
+    if (pthread_create(&thread, NULL, server_run, srv) != 0)
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
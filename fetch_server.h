@@ -0,0 +1,55 @@
+#ifndef FETCH_SERVER_H
+#define FETCH_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The peer side of file transfers: FETCH, FETCH_RANGE and FETCH_HASHES
+ * requests from other peers, answered from SharedFiles.
+ *
+ * One thread runs the registry's reactor and per-connection buffers (see
+ * reactor.h and conn.h), so any number of downloads share it without one
+ * waiting on another. A connection handles its requests in order, and file
+ * data goes out with sendfile() straight from the page cache. Anything that
+ * may wait on the disk, reading ahead of the data about to be sent or
+ * hashing a file, is handed to a small thread pool, which gives the
+ * connection back to the loop through an eventfd when it is done.
+ */
+
+// Requests peers send each other; the registry's are in protocol.h
+#define FETCH        0x03   // null-terminated filename
+#define FETCH_RANGE  0x0E   // 8 byte offset, 8 byte length, filename
+#define FETCH_HASHES 0x0F   // filename
+
+// A FETCH is answered with a 1 byte response code (0 if the file is shared)
+// and the whole file, then the connection is closed. A FETCH_RANGE gets the
+// response code, the 8 byte file size and the part of the range that
+// exists. A FETCH_HASHES gets the response code, file size, 4 byte chunk
+// size, 4 byte chunk count and the 8 byte chunk_hash() of every chunk.
+// Every number is in network byte order.
+#define RANGE_HEADER_LEN 9
+#define HASHES_HEADER_LEN 17
+#define FETCH_CHUNK (4 << 20)   // chunk size of FETCH_HASHES
+
+// Serves the listening socket from a background thread. Returns -1 if the
+// event loop or its threads can't be set up.
+int fetch_server_start(int listen_socket);
+
+// 64-bit hash of a chunk. It catches corrupt and missing data, not
+// deliberate tampering.
+uint64_t chunk_hash(const unsigned char *p, size_t len);
+
+static inline void put_u64(unsigned char *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static inline uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+#endif
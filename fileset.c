@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <string.h>
+#include "catalog.h"
+#include "fileset.h"
+
+#define FILE_SET_MIN 8
+#define EMPTY CATALOG_NONE
+#define TOMBSTONE (CATALOG_NONE - 1)
+
+// Fibonacci hashing spreads consecutive ids across the table
+static int slot_for(uint32_t id, int capacity) {
+    return (int)((id * 2654435769u) & (uint32_t)(capacity - 1));
+}
+
+void file_set_init(struct file_set *s) {
+    s->slots = NULL;
+    s->capacity = 0;
+    s->count = 0;
+    s->used = 0;
+}
+
+void file_set_free(struct file_set *s) {
+    free(s->slots);
+    file_set_init(s);
+}
+
+void file_set_clear(struct file_set *s) {
+    if (s->slots != NULL)
+        memset(s->slots, 0xFF, s->capacity * sizeof *s->slots);
+    s->count = 0;
+    s->used = 0;
+}
+
+uint32_t file_set_at(const struct file_set *s, int i) {
+    uint32_t id = s->slots[i];
+    return id == TOMBSTONE ? EMPTY : id;
+}
+
+// Slot holding id, or -1
+static int file_set_find(const struct file_set *s, uint32_t id) {
+    if (s->capacity == 0)
+        return -1;
+    int mask = s->capacity - 1;
+    for (int i = slot_for(id, s->capacity); s->slots[i] != EMPTY; i = (i + 1) & mask) {
+        if (s->slots[i] == id)
+            return i;
+    }
+    return -1;
+}
+
+// Rehashes into capacity slots, dropping tombstones
+static int file_set_resize(struct file_set *s, int capacity) {
+    uint32_t *slots = malloc(capacity * sizeof *slots);
+    if (slots == NULL)
+        return -1;
+    memset(slots, 0xFF, capacity * sizeof *slots);
+    for (int i = 0; i < s->capacity; i++) {
+        uint32_t id = file_set_at(s, i);
+        if (id == EMPTY)
+            continue;
+        int j = slot_for(id, capacity);
+        while (slots[j] != EMPTY)
+            j = (j + 1) & (capacity - 1);
+        slots[j] = id;
+    }
+    free(s->slots);
+    s->slots = slots;
+    s->capacity = capacity;
+    s->used = s->count;
+    return 0;
+}
+
+int file_set_add(struct file_set *s, uint32_t id) {
+    if (file_set_find(s, id) != -1)
+        return 0;
+
+    // keep the table at most 3/4 full counting tombstones
+    if ((s->used + 1) * 4 > s->capacity * 3) {
+        int capacity = s->capacity ? s->capacity : FILE_SET_MIN;
+        while ((s->count + 1) * 2 > capacity)
+            capacity *= 2;
+        if (file_set_resize(s, capacity) == -1)
+            return -1;
+    }
+
+    int mask = s->capacity - 1;
+    int i = slot_for(id, s->capacity);
+    while (s->slots[i] != EMPTY && s->slots[i] != TOMBSTONE)
+        i = (i + 1) & mask;
+    if (s->slots[i] == EMPTY)
+        s->used++;
+    s->slots[i] = id;
+    s->count++;
+    return 1;
+}
+
+int file_set_remove(struct file_set *s, uint32_t id) {
+    int i = file_set_find(s, id);
+    if (i == -1)
+        return 0;
+    s->slots[i] = TOMBSTONE;
+    s->count--;
+    return 1;
+}
@@ -0,0 +1,26 @@
+#ifndef FILESET_H
+#define FILESET_H
+
+#include <stdint.h>
+
+// Open-addressing set of the catalog ids one peer has published, so a delta
+// can add or drop one file in O(1). Each file costs a 4 byte slot.
+struct file_set {
+    uint32_t *slots;
+    int capacity;   // power of two, 0 until the first add
+    int count;      // live ids
+    int used;       // live ids plus tombstones
+};
+
+void file_set_init(struct file_set *s);
+void file_set_free(struct file_set *s);
+
+// Returns 1 if id was added, 0 if it was already there, -1 if out of memory
+int file_set_add(struct file_set *s, uint32_t id);
+// Returns 1 if id was removed, 0 if it wasn't in the set
+int file_set_remove(struct file_set *s, uint32_t id);
+// Returns the id in slot i (0 <= i < capacity), or CATALOG_NONE if it's empty
+uint32_t file_set_at(const struct file_set *s, int i);
+void file_set_clear(struct file_set *s);
+
+#endif
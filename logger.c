@@ -0,0 +1,253 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "logger.h"
+
+#define LOG_RING_SIZE (512 * 1024)  // per thread, a power of two
+#define LOG_MAX_RECORD (64 * 1024)
+#define LOG_MIN_RECORD 256          // less room than this and the record is dropped
+#define LOG_MAX_THREADS 512
+#define LOG_WRAP 0xFFFFFFFFu        // header meaning "continue at the start of the ring"
+
+// A ring is laid out as records of a 4 byte length header followed by the
+// text, padded to 4 bytes. head and tail only grow; their difference is the
+// number of bytes in use. Each is written by one side only.
+struct log_ring {
+    uint32_t head;              // producer
+    char pad1[60];
+    uint32_t tail;              // logger thread
+    char pad2[60];
+    uint64_t dropped;           // producer
+    uint64_t reported;          // logger thread
+
+    // the record being built, producer only
+    int active;
+    uint32_t pos;               // ring position of its header
+    char *text;
+    size_t cap;
+    size_t len;
+    unsigned int sampled;
+
+    unsigned char buf[LOG_RING_SIZE];
+};
+
+static struct log_ring *rings[LOG_MAX_THREADS];
+static int ring_count;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct log_ring *self;
+
+static int min_level = LOG_DEBUG;
+static unsigned int sample_every = 1;
+static pthread_t logger_thread;
+static int running;
+static int stopping;
+
+// The logger thread blocks on wake_seq while every ring is empty, with
+// sleeping set so that producers know to bump wake_seq and wake it
+static uint32_t wake_seq;
+static int sleeping;
+
+// Hands the calling thread a ring the first time it logs
+static struct log_ring *log_self(void) {
+    if (self == NULL) {
+        struct log_ring *r = calloc(1, sizeof *r);
+        if (r == NULL)
+            return NULL;
+        pthread_mutex_lock(&ring_lock);
+        if (ring_count == LOG_MAX_THREADS) {
+            pthread_mutex_unlock(&ring_lock);
+            free(r);
+            return NULL;
+        }
+        rings[ring_count] = r;
+        __atomic_store_n(&ring_count, ring_count + 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&ring_lock);
+        self = r;
+    }
+    return self;
+}
+
+static uint32_t padded(size_t len) {
+    return (len + 3) & ~3u;
+}
+
+void log_begin(int level) {
+    struct log_ring *r = log_self();
+    if (r == NULL)
+        return;
+    r->active = 0;
+    if (level < min_level)
+        return;
+    if (level < LOG_WARN && sample_every > 1 && r->sampled++ % sample_every != 0)
+        return;
+
+    uint32_t head = r->head;
+    uint32_t free_bytes = LOG_RING_SIZE - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+    uint32_t to_end = LOG_RING_SIZE - (head & (LOG_RING_SIZE - 1));
+    uint32_t pos = head;
+    uint32_t room = to_end < free_bytes ? to_end : free_bytes;
+
+    // start over at the front rather than squeeze a record into the end
+    if (room < 4 + LOG_MAX_RECORD && free_bytes >= to_end && free_bytes - to_end > room) {
+        uint32_t wrap = LOG_WRAP;
+        memcpy(&r->buf[head & (LOG_RING_SIZE - 1)], &wrap, 4);
+        pos = head + to_end;
+        room = free_bytes - to_end;
+    }
+    if (room < 4 + LOG_MIN_RECORD) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    r->active = 1;
+    r->pos = pos;
+    r->text = (char *)&r->buf[(pos & (LOG_RING_SIZE - 1)) + 4];
+    r->cap = room - 4 < LOG_MAX_RECORD ? room - 4 : LOG_MAX_RECORD;
+    r->len = 0;
+}
+
+static void log_vappend(struct log_ring *r, const char *fmt, va_list ap) {
+    size_t left = r->cap - r->len;
+    int n = vsnprintf(r->text + r->len, left, fmt, ap);
+    if (n < 0)
+        return;
+    if ((size_t)n >= left) {
+        // cut short, but keep the record a whole line
+        r->len = r->cap;
+        r->text[r->len - 1] = '\n';
+        return;
+    }
+    r->len += n;
+}
+
+void log_append(const char *fmt, ...) {
+    struct log_ring *r = self;
+    if (r == NULL || !r->active)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    log_vappend(r, fmt, ap);
+    va_end(ap);
+}
+
+static void logger_wake(void) {
+    __atomic_add_fetch(&wake_seq, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void log_end(void) {
+    struct log_ring *r = self;
+    if (r == NULL || !r->active)
+        return;
+    r->active = 0;
+    uint32_t len = r->len;
+    memcpy(&r->buf[r->pos & (LOG_RING_SIZE - 1)], &len, 4);
+    // pairs with the acquire in log_drain(): the text is written first
+    __atomic_store_n(&r->head, r->pos + 4 + padded(len), __ATOMIC_RELEASE);
+
+    // Only a record landing while the logger is asleep costs a system call.
+    // The fence pairs with the one in logger_run(): either the logger sees
+    // this head before it waits, or this sees sleeping and wakes it.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&sleeping, 0, __ATOMIC_RELAXED))
+        logger_wake();
+}
+
+void log_printf(int level, const char *fmt, ...) {
+    log_begin(level);
+    struct log_ring *r = self;
+    if (r == NULL || !r->active)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    log_vappend(r, fmt, ap);
+    va_end(ap);
+    log_end();
+}
+
+// Writes every finished record to stdout. Returns how many bytes were written.
+static size_t log_drain(void) {
+    size_t written = 0;
+    int n = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        struct log_ring *r = rings[i];
+        uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = r->tail;
+        while (tail != head) {
+            uint32_t off = tail & (LOG_RING_SIZE - 1);
+            uint32_t len;
+            memcpy(&len, &r->buf[off], 4);
+            if (len == LOG_WRAP) {
+                tail += LOG_RING_SIZE - off;
+                continue;
+            }
+            fwrite(&r->buf[off + 4], 1, len, stdout);
+            written += len;
+            tail += 4 + padded(len);
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        if (dropped != r->reported) {
+            written += printf("[WARN] log: dropped %llu records\n", (unsigned long long)(dropped - r->reported));
+            r->reported = dropped;
+        }
+    }
+    return written;
+}
+
+static void *logger_run(void *arg) {
+    (void)arg;
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        if (log_drain() > 0) {
+            fflush(stdout);
+            continue;
+        }
+        // announce the sleep, then look once more before blocking, so a
+        // record published in between is either drained here or wakes us
+        uint32_t seq = __atomic_load_n(&wake_seq, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (log_drain() > 0)
+            fflush(stdout);
+        else if (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+            syscall(SYS_futex, &wake_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+        __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+    }
+    log_drain();
+    fflush(stdout);
+    return NULL;
+}
+
+int logger_init(int level, unsigned int sample) {
+    min_level = level;
+    sample_every = sample ? sample : 1;
+    if (pthread_create(&logger_thread, NULL, logger_run, NULL) != 0)
+        return -1;
+    running = 1;
+    return 0;
+}
+
+void logger_shutdown(void) {
+    if (!running)
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    logger_wake();
+    pthread_join(logger_thread, NULL);
+    running = 0;
+}
+
+int logger_level(const char *name) {
+    static const char *const names[] = { "debug", "info", "warn", "error" };
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
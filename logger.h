@@ -0,0 +1,44 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/*
+ * Asynchronous logging for the event loops.
+ *
+ * Each thread that logs gets its own single-producer ring. A record is
+ * rendered straight into the ring and published with one release store, so
+ * logging never takes a lock. A background thread copies finished records
+ * to stdout and flushes, which means a slow terminal or a full pipe stalls
+ * only that thread. The logger thread blocks while every ring is empty;
+ * the first record after that makes one system call to wake it, and no
+ * other record makes any. When a ring is full, records are dropped and
+ * counted, and the logger thread reports the count.
+ *
+ * Records below min_level are skipped. DEBUG and INFO records can also be
+ * sampled, keeping 1 in every sample records per thread. WARN and ERROR
+ * are never sampled.
+ */
+
+#define LOG_DEBUG 0
+#define LOG_INFO  1     // the TEST] lines
+#define LOG_WARN  2
+#define LOG_ERROR 3
+
+// Starts the logger thread. Returns 0 on success, -1 if it can't start, in
+// which case records stay in the rings until they fill up.
+int logger_init(int min_level, unsigned int sample);
+// Writes out everything logged so far and stops the logger thread
+void logger_shutdown(void);
+// Parses "debug", "info", "warn" or "error"; returns -1 for anything else
+int logger_level(const char *name);
+
+// Logs one printf-style record; the format supplies its own newline
+void log_printf(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// A record can also be built in pieces when its length isn't known up front:
+// log_begin(), any number of log_append(), then log_end(). Nothing is visible
+// to the logger thread until log_end(). Overlong records are cut short.
+void log_begin(int level);
+void log_append(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void log_end(void);
+
+#endif
@@ -0,0 +1,162 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+#include "protocol.h"
+
+static struct metrics *registered[METRICS_MAX_WORKERS];
+static int registered_count;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t started;
+
+// Request names for the report, indexed by opcode
+static const char *const op_names[METRICS_OPCODES] = {
+    [CMD_JOIN] = "JOIN",
+    [CMD_PUBLISH] = "PUBLISH",
+    [CMD_SEARCH] = "SEARCH",
+    [CMD_MSEARCH] = "MSEARCH",
+    [CMD_SEARCHK] = "SEARCHK",
+    [CMD_PUBLISH_ADD] = "PUBLISH_ADD",
+    [CMD_PUBLISH_REMOVE] = "PUBLISH_REMOVE",
+    [CMD_VERSION] = "VERSION",
+    [CMD_FIND] = "FIND",
+    [CMD_STATS] = "STATS",
+    [CMD_REPLICATE] = "REPLICATE",
+    [CMD_CLUSTER] = "CLUSTER",
+    [CMD_PING] = "PING",
+};
+
+static int hist_bucket(uint64_t v) {
+    if (v < (1u << HIST_SUB_BITS))
+        return v;
+    int e = 63 - __builtin_clzll(v);   // e >= HIST_SUB_BITS
+    int sub = (v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+// Largest value that falls into bucket b
+static uint64_t hist_bucket_max(int b) {
+    if (b < (1 << HIST_SUB_BITS))
+        return b;
+    int e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = b & ((1u << HIST_SUB_BITS) - 1);
+    uint64_t low = ((1ull << HIST_SUB_BITS) + sub) << (e - HIST_SUB_BITS);
+    return low + (1ull << (e - HIST_SUB_BITS)) - 1;
+}
+
+void histogram_record(struct histogram *h, uint64_t value) {
+    metrics_add(&h->buckets[hist_bucket(value)], 1);
+    metrics_add(&h->count, 1);
+    metrics_add(&h->sum, value);
+    if (value > __atomic_load_n(&h->max, __ATOMIC_RELAXED))
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double q) {
+    uint64_t rank = (uint64_t)(q * h->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank)
+            return hist_bucket_max(b) < h->max ? hist_bucket_max(b) : h->max;
+    }
+    return h->max;
+}
+
+void metrics_register(struct metrics *m) {
+    memset(m, 0, sizeof *m);
+    pthread_mutex_lock(&metrics_lock);
+    if (registered_count == 0)
+        started = metrics_now();
+    if (registered_count < METRICS_MAX_WORKERS)
+        registered[registered_count++] = m;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint64_t load(const uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void histogram_merge(struct histogram *sum, const struct histogram *h) {
+    sum->count += load(&h->count);
+    sum->sum += load(&h->sum);
+    if (load(&h->max) > sum->max)
+        sum->max = load(&h->max);
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        sum->buckets[b] += load(&h->buckets[b]);
+}
+
+static void print_histogram(FILE *out, const char *name, const struct histogram *h) {
+    fprintf(out, "%s count %llu mean %llu p50 %llu p90 %llu p99 %llu p999 %llu max %llu\n",
+        name,
+        (unsigned long long)h->count,
+        (unsigned long long)(h->count ? h->sum / h->count : 0),
+        (unsigned long long)histogram_percentile(h, 0.50),
+        (unsigned long long)histogram_percentile(h, 0.90),
+        (unsigned long long)histogram_percentile(h, 0.99),
+        (unsigned long long)histogram_percentile(h, 0.999),
+        (unsigned long long)h->max);
+}
+
+char *metrics_dump(void) {
+    struct metrics *sum = calloc(1, sizeof *sum);
+    if (sum == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&metrics_lock);
+    int workers = registered_count;
+    for (int i = 0; i < workers; i++) {
+        const struct metrics *m = registered[i];
+        sum->accepts += load(&m->accepts);
+        sum->bytes_in += load(&m->bytes_in);
+        sum->bytes_out += load(&m->bytes_out);
+        sum->wakeups += load(&m->wakeups);
+        sum->syscalls += load(&m->syscalls);
+        sum->timeouts += load(&m->timeouts);
+        histogram_merge(&sum->ready_fds, &m->ready_fds);
+        for (int op = 0; op < METRICS_OPCODES; op++)
+            histogram_merge(&sum->latency[op], &m->latency[op]);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    char *text = NULL;
+    size_t size;
+    FILE *out = open_memstream(&text, &size);
+    if (out == NULL) {
+        free(sum);
+        return NULL;
+    }
+    fprintf(out, "uptime_ms %llu\n", (unsigned long long)((metrics_now() - started) / 1000000));
+    fprintf(out, "workers %d\n", workers);
+    fprintf(out, "accepts %llu\n", (unsigned long long)sum->accepts);
+    fprintf(out, "bytes_in %llu\n", (unsigned long long)sum->bytes_in);
+    fprintf(out, "bytes_out %llu\n", (unsigned long long)sum->bytes_out);
+    fprintf(out, "wakeups %llu\n", (unsigned long long)sum->wakeups);
+    fprintf(out, "syscalls %llu\n", (unsigned long long)sum->syscalls);
+    fprintf(out, "timeouts %llu\n", (unsigned long long)sum->timeouts);
+    print_histogram(out, "ready_fds", &sum->ready_fds);
+    // latencies are in nanoseconds
+    for (int op = 0; op < METRICS_OPCODES; op++) {
+        if (op_names[op] == NULL || sum->latency[op].count == 0)
+            continue;
+        char name[32];
+        snprintf(name, sizeof name, "latency_ns %s", op_names[op]);
+        print_histogram(out, name, &sum->latency[op]);
+    }
+    free(sum);
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
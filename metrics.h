@@ -0,0 +1,60 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+/*
+ * Counters and latency histograms for the registry.
+ *
+ * Every worker owns one struct metrics and is the only thread that writes
+ * it, so recording is a plain load and store with no locks or atomic
+ * read-modify-write. A STATS request sums every registered worker's
+ * metrics with relaxed loads; the snapshot may be a few events behind but
+ * is never torn.
+ *
+ * Histograms are HDR-style log-linear: values below 8 are exact, larger
+ * ones fall into 8 buckets per power of two, so any reported percentile
+ * is within 12.5% of the true value.
+ */
+
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define METRICS_OPCODES 16      // request opcodes tracked, indexed by CMD_*
+#define METRICS_MAX_WORKERS 512
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+struct metrics {
+    uint64_t accepts;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t wakeups;                       // reactor_wait() or uring_enter() calls that returned
+    uint64_t syscalls;                      // socket and event system calls of the event loop
+    uint64_t timeouts;                      // connections closed as idle or stalled
+    struct histogram ready_fds;             // ready fds per wakeup
+    struct histogram latency[METRICS_OPCODES];  // request handling time in ns
+};
+
+// Adds n to a counter owned by the calling thread
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void histogram_record(struct histogram *h, uint64_t value);
+// Upper bound of the bucket holding the q-th quantile (0 < q <= 1)
+uint64_t histogram_percentile(const struct histogram *h, double q);
+
+// Zeroes m and adds it to the set that metrics_dump() reports
+void metrics_register(struct metrics *m);
+// Monotonic clock in nanoseconds
+uint64_t metrics_now(void);
+// Returns a malloc'd text report summing every registered struct metrics,
+// one "name value..." line per counter or histogram, or NULL if out of memory
+char *metrics_dump(void);
+
+#endif
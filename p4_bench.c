@@ -0,0 +1,576 @@
+/*
+ * p4_bench: closed-loop load generator for program4.
+ *
+ * Opens many synthetic peers over TCP. Each one JOINs and PUBLISHes its
+ * share of a synthetic catalog, then keeps exactly one request in flight
+ * for the length of the run, picking JOIN, PUBLISH or SEARCH by weight.
+ * JOIN and PUBLISH have no response of their own, so each is followed by a
+ * VERSION request and counts as done when that answer arrives. At the end
+ * it prints throughput, p50/p99/p999 latency per request type, the
+ * registry's system calls per request (from STATS, so over loopback) and,
+ * given the registry's pid, its resident set size.
+ *
+ * With -C the registry is one member of a sharded cluster. The bench asks
+ * it for the member list and acts as a shard-aware client: every peer
+ * connects to every member, JOINs all of them and PUBLISHes to each only
+ * the names it owns, and each SEARCH goes to the owner alone.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "metrics.h"
+#include "protocol.h"
+#include "reactor.h"
+#include "shard.h"
+
+#define MAX_EVENTS 256
+#define SEARCH_RESPONSE_LEN 14
+#define MAX_FILES_PER_PEER 10000
+#define OP_JOIN 0
+#define OP_PUBLISH 1
+#define OP_SEARCH 2
+#define OP_COUNT 3
+
+static const char *const op_names[OP_COUNT] = { "JOIN", "PUBLISH", "SEARCH" };
+
+struct bench_options {
+    const char *host;
+    const char *port;
+    int cluster;                // shard-aware: fetch the member list with CLUSTER
+    int conns;
+    int seconds;
+    int files;                  // catalog size across all peers
+    int weights[OP_COUNT];
+    long registry_pid;          // 0 if unknown
+};
+
+struct peer;
+
+// A peer's connection to one cluster member
+struct link {
+    int fd;
+    struct peer *peer;
+    int shard;
+    unsigned char *out;         // request bytes not yet sent
+    size_t out_len;
+    size_t out_sent;
+    size_t expect;              // response bytes still to come
+    int events;
+};
+
+// One synthetic peer with its single outstanding request, which may be
+// spread over several members
+struct peer {
+    uint32_t id;
+    int first_file;             // publishes files [first_file, first_file + file_count)
+    int file_count;
+    int op;                     // OP_*, or -1 during setup
+    uint64_t started;
+    struct link *links;         // one per member
+    int pending;                // links still waiting for their response
+};
+
+static struct bench_options opts;
+static struct shard_ring ring;
+static struct link **by_fd;
+static int by_fd_size;
+static struct reactor reactor;
+static struct histogram latency[OP_COUNT];
+static uint64_t completed[OP_COUNT];
+static unsigned int rng = 2463534242u;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-c conns] [-d seconds] [-f catalog_files] [-m join:publish:search]\n"
+        "          [-P registry_pid] [-C] <host> <port>\n", prog);
+    exit(1);
+}
+
+static unsigned int next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static void file_name(char *buf, size_t size, int n) {
+    snprintf(buf, size, "bench-%07d.dat", n);
+}
+
+// Appends len bytes to a growing buffer
+static void append(unsigned char **buf, size_t *len, size_t *cap, const void *data, size_t n) {
+    if (*len + n > *cap) {
+        *cap = (*len + n) * 2;
+        *buf = realloc(*buf, *cap);
+        if (*buf == NULL) {
+            perror("ERROR allocating request");
+            exit(1);
+        }
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+// Builds the request bytes for op on one link and the response size to wait
+// for. A link with no part in the request is left with nothing to send.
+static void build_link_request(struct peer *p, struct link *l, int op, const char *search) {
+    size_t len = 0, cap = 0;
+    unsigned char *buf = NULL;
+    char name[32];
+
+    if (op == OP_JOIN || op == -1) {
+        uint32_t net_id = htonl(p->id);
+        append(&buf, &len, &cap, "\x00", 1);
+        append(&buf, &len, &cap, &net_id, 4);
+    }
+    if (op == OP_PUBLISH || op == -1) {
+        // the count is patched in once the names this member owns are known
+        uint32_t count = 0;
+        size_t count_at = len + 1;
+        append(&buf, &len, &cap, "\x01", 1);
+        append(&buf, &len, &cap, &count, 4);
+        for (int i = 0; i < p->file_count; i++) {
+            file_name(name, sizeof name, p->first_file + i);
+            if (shard_owner(&ring, name) != l->shard)
+                continue;
+            append(&buf, &len, &cap, name, strlen(name) + 1);
+            count++;
+        }
+        uint32_t net_count = htonl(count);
+        memcpy(buf + count_at, &net_count, 4);
+    }
+    if (op == OP_SEARCH) {
+        l->expect = 0;
+        if (shard_owner(&ring, search) == l->shard) {
+            append(&buf, &len, &cap, "\x02", 1);
+            append(&buf, &len, &cap, search, strlen(search) + 1);
+            l->expect = SEARCH_RESPONSE_LEN;
+        }
+    } else {
+        append(&buf, &len, &cap, "\x08", 1);
+        l->expect = VERSION_RESPONSE_LEN;
+    }
+
+    free(l->out);
+    l->out = buf;
+    l->out_len = len;
+    l->out_sent = 0;
+}
+
+static void build_request(struct peer *p, int op) {
+    char search[32];
+    if (op == OP_SEARCH)
+        file_name(search, sizeof search, next_random() % opts.files);
+    p->op = op;
+    p->pending = 0;
+    for (int i = 0; i < ring.member_count; i++) {
+        build_link_request(p, &p->links[i], op, search);
+        p->pending += p->links[i].expect > 0;
+    }
+}
+
+static int pick_op(void) {
+    int total = opts.weights[OP_JOIN] + opts.weights[OP_PUBLISH] + opts.weights[OP_SEARCH];
+    int r = next_random() % total;
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (r < opts.weights[op])
+            return op;
+        r -= opts.weights[op];
+    }
+    return OP_SEARCH;
+}
+
+static void watch(struct link *l, int events) {
+    if (events != l->events && reactor_mod(&reactor, l->fd, events) == 0)
+        l->events = events;
+}
+
+// Sends what the socket takes; returns -1 on error
+static int send_pending(struct link *l) {
+    while (l->out_sent < l->out_len) {
+        ssize_t n = send(l->fd, l->out + l->out_sent, l->out_len - l->out_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            watch(l, REACTOR_READ | REACTOR_WRITE);
+            return 0;
+        }
+        if (n < 0)
+            return -1;
+        l->out_sent += n;
+    }
+    watch(l, REACTOR_READ);
+    return 0;
+}
+
+static void start_request(struct peer *p, int op) {
+    build_request(p, op);
+    p->started = metrics_now();
+    for (int i = 0; i < ring.member_count; i++) {
+        if (send_pending(&p->links[i]) == -1) {
+            perror("ERROR sending request");
+            exit(1);
+        }
+    }
+}
+
+// Drains the socket. Returns 1 once the link's response is complete.
+static int receive(struct link *l) {
+    unsigned char buf[4096];
+    int done = 0;
+    while (1) {
+        ssize_t n = recv(l->fd, buf, sizeof buf, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return done;
+        if (n <= 0) {
+            fprintf(stderr, "ERROR: registry closed connection of peer %u\n", l->peer->id);
+            exit(1);
+        }
+        if ((size_t)n > l->expect) {
+            fprintf(stderr, "ERROR: unexpected response bytes for peer %u\n", l->peer->id);
+            exit(1);
+        }
+        l->expect -= n;
+        done = l->expect == 0;
+    }
+}
+
+static int connect_member(const struct addrinfo *ai) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1 || connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+        perror("ERROR connecting to registry");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return fd;
+}
+
+// Registers the peer's connection to member shard
+static void add_link(struct peer *p, int shard, int fd) {
+    if (fd >= by_fd_size) {
+        int size = by_fd_size ? by_fd_size : 1024;
+        while (size <= fd)
+            size *= 2;
+        by_fd = realloc(by_fd, size * sizeof *by_fd);
+        if (by_fd == NULL) {
+            perror("ERROR allocating peers");
+            exit(1);
+        }
+        memset(by_fd + by_fd_size, 0, (size - by_fd_size) * sizeof *by_fd);
+        by_fd_size = size;
+    }
+    struct link *l = &p->links[shard];
+    l->fd = fd;
+    l->peer = p;
+    l->shard = shard;
+    l->events = REACTOR_READ;
+    by_fd[fd] = l;
+}
+
+static struct peer *connect_peer(struct addrinfo **members, uint32_t id) {
+    struct peer *p = calloc(1, sizeof *p);
+    if (p != NULL)
+        p->links = calloc(ring.member_count, sizeof *p->links);
+    if (p == NULL || p->links == NULL) {
+        perror("ERROR allocating peers");
+        exit(1);
+    }
+    p->id = id;
+    for (int i = 0; i < ring.member_count; i++) {
+        int fd = connect_member(members[i]);
+        if (set_nonblocking(fd) == -1 || reactor_add(&reactor, fd, REACTOR_READ) == -1) {
+            perror("ERROR watching connection");
+            exit(1);
+        }
+        add_link(p, i, fd);
+    }
+    return p;
+}
+
+// Runs the event loop until every outstanding request completes (setup) or
+// the deadline passes (measured run)
+static void run(uint64_t deadline, int measure, int *outstanding) {
+    struct reactor_event events[MAX_EVENTS];
+    while (*outstanding > 0) {
+        uint64_t now = metrics_now();
+        if (measure && now >= deadline)
+            return;
+        int timeout = measure ? (int)((deadline - now) / 1000000) + 1 : 1000;
+        int n = reactor_wait(&reactor, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("ERROR waiting for events");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            struct link *l = by_fd[events[i].fd];
+            if ((events[i].events & REACTOR_WRITE) && send_pending(l) == -1) {
+                perror("ERROR sending request");
+                exit(1);
+            }
+            if (!(events[i].events & REACTOR_READ) || !receive(l))
+                continue;
+            struct peer *p = l->peer;
+            if (--p->pending > 0)
+                continue;
+
+            if (!measure) {
+                (*outstanding)--;
+                continue;
+            }
+            uint64_t done = metrics_now();
+            histogram_record(&latency[p->op], done - p->started);
+            completed[p->op]++;
+            if (done < deadline)
+                start_request(p, pick_op());
+        }
+    }
+}
+
+// Resident set size of pid in KiB from /proc, or -1
+static long rss_kib(long pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof path, "/proc/%ld/status", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    long kib = -1;
+    while (fgets(line, sizeof line, f) != NULL) {
+        if (sscanf(line, "VmRSS: %ld", &kib) == 1)
+            break;
+    }
+    fclose(f);
+    return kib;
+}
+
+static void parse_mix(const char *arg, const char *prog) {
+    if (sscanf(arg, "%d:%d:%d", &opts.weights[OP_JOIN], &opts.weights[OP_PUBLISH], &opts.weights[OP_SEARCH]) != 3 ||
+        opts.weights[OP_JOIN] < 0 || opts.weights[OP_PUBLISH] < 0 || opts.weights[OP_SEARCH] < 0 ||
+        opts.weights[OP_JOIN] + opts.weights[OP_PUBLISH] + opts.weights[OP_SEARCH] == 0)
+        usage(prog);
+}
+
+// Asks the registry at host:port for its cluster's member list. Returns it
+// as a string to free, or exits.
+static char *fetch_cluster(const struct addrinfo *ai) {
+    int fd = connect_member(ai);
+    unsigned char cmd = CMD_CLUSTER;
+    uint32_t net_len;
+    if (send(fd, &cmd, 1, MSG_NOSIGNAL) != 1 || recv(fd, &net_len, 4, MSG_WAITALL) != 4) {
+        perror("ERROR asking for the cluster");
+        exit(1);
+    }
+    size_t len = ntohl(net_len);
+    char *spec = malloc(len + 1);
+    if (spec == NULL || (len > 0 && recv(fd, spec, len, MSG_WAITALL) != (ssize_t)len)) {
+        perror("ERROR reading the cluster");
+        exit(1);
+    }
+    spec[len] = '\0';
+    close(fd);
+    if (len == 0) {
+        fprintf(stderr, "%s:%s is not a member of a cluster\n", opts.host, opts.port);
+        exit(1);
+    }
+    return spec;
+}
+
+// Sums the syscalls counters of every member's STATS report; 0 where the
+// member won't say, as it only reports to local peers
+static uint64_t registry_syscalls(struct addrinfo **members) {
+    uint64_t total = 0;
+    for (int i = 0; i < ring.member_count; i++) {
+        int fd = connect_member(members[i]);
+        unsigned char cmd = CMD_STATS;
+        uint32_t net_len;
+        if (send(fd, &cmd, 1, MSG_NOSIGNAL) != 1 || recv(fd, &net_len, 4, MSG_WAITALL) != 4) {
+            perror("ERROR asking for STATS");
+            exit(1);
+        }
+        size_t len = ntohl(net_len);
+        char *text = malloc(len + 1);
+        if (text == NULL || (len > 0 && recv(fd, text, len, MSG_WAITALL) != (ssize_t)len)) {
+            perror("ERROR reading STATS");
+            exit(1);
+        }
+        text[len] = '\0';
+        close(fd);
+        const char *line = strstr(text, "\nsyscalls ");
+        if (line != NULL)
+            total += strtoull(line + strlen("\nsyscalls "), NULL, 10);
+        free(text);
+    }
+    return total;
+}
+
+static struct addrinfo *resolve(const char *host, const char *port) {
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, port, &hints, &ai);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo %s:%s: %s\n", host, port, gai_strerror(rc));
+        exit(1);
+    }
+    return ai;
+}
+
+// Raises the open file limit so thousands of peers fit
+static void raise_fd_limit(int conns) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)conns + 64) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    opts.conns = 1000;
+    opts.seconds = 10;
+    opts.files = 100000;
+    opts.weights[OP_JOIN] = 1;
+    opts.weights[OP_PUBLISH] = 4;
+    opts.weights[OP_SEARCH] = 95;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:f:m:P:C")) != -1) {
+        switch (opt) {
+        case 'c': opts.conns = atoi(optarg); break;
+        case 'd': opts.seconds = atoi(optarg); break;
+        case 'f': opts.files = atoi(optarg); break;
+        case 'm': parse_mix(optarg, argv[0]); break;
+        case 'P': opts.registry_pid = atol(optarg); break;
+        case 'C': opts.cluster = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || opts.conns < 1 || opts.seconds < 1 || opts.files < 1)
+        usage(argv[0]);
+    opts.host = argv[optind];
+    opts.port = argv[optind + 1];
+
+    int per_peer = (opts.files + opts.conns - 1) / opts.conns;
+    if (per_peer > MAX_FILES_PER_PEER) {
+        fprintf(stderr, "%d files over %d peers is more than %d per PUBLISH; use more peers\n",
+            opts.files, opts.conns, MAX_FILES_PER_PEER);
+        exit(1);
+    }
+
+    // Without -C the registry is a cluster of one
+    struct addrinfo *ai = resolve(opts.host, opts.port);
+    char *spec = NULL;
+    if (opts.cluster) {
+        spec = fetch_cluster(ai);
+    } else {
+        spec = malloc(strlen(opts.host) + strlen(opts.port) + 2);
+        if (spec == NULL) {
+            perror("ERROR allocating cluster");
+            exit(1);
+        }
+        sprintf(spec, "%s:%s", opts.host, opts.port);
+    }
+    freeaddrinfo(ai);
+    if (shard_ring_init(&ring, spec) == -1) {
+        fprintf(stderr, "bad cluster member list: %s\n", spec);
+        exit(1);
+    }
+    free(spec);
+    struct addrinfo **members = calloc(ring.member_count, sizeof *members);
+    if (members == NULL) {
+        perror("ERROR allocating cluster");
+        exit(1);
+    }
+    for (int i = 0; i < ring.member_count; i++) {
+        char host[256];
+        const char *port;
+        shard_split_address(ring.members[i], host, sizeof host, &port);
+        members[i] = resolve(host, port);
+    }
+    raise_fd_limit(opts.conns * ring.member_count);
+    if (reactor_init(&reactor) == -1) {
+        perror("ERROR creating reactor");
+        exit(1);
+    }
+
+    // Setup: every peer joins and publishes its slice of the catalog
+    struct peer **peers = calloc(opts.conns, sizeof *peers);
+    if (peers == NULL) {
+        perror("ERROR allocating peers");
+        exit(1);
+    }
+    uint64_t setup_start = metrics_now();
+    for (int i = 0; i < opts.conns; i++) {
+        struct peer *p = peers[i] = connect_peer(members, i + 1);
+        p->first_file = i * per_peer;
+        p->file_count = p->first_file >= opts.files ? 0
+            : (opts.files - p->first_file < per_peer ? opts.files - p->first_file : per_peer);
+        start_request(p, -1);
+    }
+    int outstanding = opts.conns;
+    run(0, 0, &outstanding);
+    uint64_t setup_ns = metrics_now() - setup_start;
+    long rss_after_setup = opts.registry_pid ? rss_kib(opts.registry_pid) : -1;
+    uint64_t syscalls_before = registry_syscalls(members);
+
+    // Measured run: one request in flight per peer
+    uint64_t start = metrics_now();
+    uint64_t deadline = start + (uint64_t)opts.seconds * 1000000000u;
+    for (int i = 0; i < opts.conns; i++)
+        start_request(peers[i], pick_op());
+    outstanding = opts.conns;
+    run(deadline, 1, &outstanding);
+    double elapsed = (metrics_now() - start) / 1e9;
+    uint64_t syscalls = registry_syscalls(members) - syscalls_before;
+    for (int i = 0; i < ring.member_count; i++)
+        freeaddrinfo(members[i]);
+    free(members);
+
+    uint64_t total = 0;
+    for (int op = 0; op < OP_COUNT; op++)
+        total += completed[op];
+    printf("peers %d  shards %d  catalog %d files  mix %d:%d:%d  setup %.2f s\n", opts.conns, ring.member_count,
+        opts.files, opts.weights[OP_JOIN], opts.weights[OP_PUBLISH], opts.weights[OP_SEARCH], setup_ns / 1e9);
+    printf("throughput %.0f req/s (%llu in %.2f s)\n", total / elapsed, (unsigned long long)total, elapsed);
+    printf("%-8s %10s %10s %10s %10s %10s\n", "op", "count", "p50_us", "p99_us", "p999_us", "max_us");
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (completed[op] == 0)
+            continue;
+        printf("%-8s %10llu %10.1f %10.1f %10.1f %10.1f\n", op_names[op],
+            (unsigned long long)completed[op],
+            histogram_percentile(&latency[op], 0.50) / 1e3,
+            histogram_percentile(&latency[op], 0.99) / 1e3,
+            histogram_percentile(&latency[op], 0.999) / 1e3,
+            latency[op].max / 1e3);
+    }
+    if (syscalls > 0)
+        printf("registry syscalls %.2f per request (%llu)\n", (double)syscalls / total, (unsigned long long)syscalls);
+    if (opts.registry_pid) {
+        printf("registry rss %ld KiB after setup, %ld KiB after run\n",
+            rss_after_setup, rss_kib(opts.registry_pid));
+    }
+
+    for (int i = 0; i < opts.conns; i++) {
+        for (int j = 0; j < ring.member_count; j++) {
+            close(peers[i]->links[j].fd);
+            free(peers[i]->links[j].out);
+        }
+        free(peers[i]->links);
+        free(peers[i]);
+    }
+    free(peers);
+    free(by_fd);
+    shard_ring_free(&ring);
+    reactor_close(&reactor);
+    return 0;
+}
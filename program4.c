@@ -3,233 +3,1392 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/select.h>
 #include <netdb.h>
+#include "conn.h"
+#include "epoch.h"
+#include "logger.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "reactor.h"
+#include "registry.h"
+#include "shard.h"
+#include "snapshot.h"
+#include "timer.h"
+#include "uring.h"
+#include "wal.h"
 
-#define MAX_PEERS 5
-#define MAX_FILES 10
-#define MAX_FILENAME_LEN 100
-#define MAX_BUF_SIZE 1024
-#define MAX_PENDING 5
-
-int find_max_fd(const fd_set *fs);
-int bind_and_listen( const char *service );
-
-// Structure representing a peer entry
-struct peer_entry {
-    uint32_t id;
-    int socket_fd;
-    int file_count;
-    char files[MAX_FILES][MAX_FILENAME_LEN];
-    struct sockaddr_storage address;
+#define MAX_PENDING SOMAXCONN    // listen backlog; bursts of joining peers overflow a short one
+#define MAX_EVENTS 64
+#define MAX_WORKERS 256
+#define DEFAULT_OUT_HIGH_WATER (256 * 1024)
+#define MSEARCH_BATCH 32    // names resolved per catalog batch
+#define DEFAULT_SNAPSHOT_INTERVAL 60    // seconds
+#define DEFAULT_GHOST_GRACE 120         // seconds
+#define DEFAULT_REQUEST_TIMEOUT 30      // seconds
+#define URING_ENTRIES 1024      // io_uring submission queue size
+#define URING_BUFS 1024         // provided receive buffers per worker
+#define URING_BUF_SIZE 4096
+
+// user_data of an io_uring request: what it is, the uring_id of its
+// connection and the socket. The id keeps a late completion for a socket
+// handed off to another thread apart from a new socket with the same fd.
+enum uring_op { UOP_ACCEPT, UOP_RECV, UOP_SEND, UOP_CANCEL, UOP_CLOSE, UOP_TAKEOVER };
+#define URING_DATA(op, id, fd) ((uint64_t)(op) << 56 | (uint64_t)((id) & 0xffffff) << 32 | (uint32_t)(fd))
+
+// Command-line settings shared by every worker
+struct options {
+    const char *port;
+    int workers;
+    size_t out_high_water;  // stop reading from a peer with this much unsent output
+    int log_level;          // LOG_* below which records are skipped
+    unsigned int log_sample;    // keep 1 in this many DEBUG/INFO records
+    const char *snapshot_path;  // NULL to run without snapshots
+    int snapshot_interval;      // seconds between snapshots
+    int ghost_grace;            // seconds restored peers have to re-JOIN
+    const char *wal_path;       // NULL to run without a write-ahead log
+    const char *primary;        // host:port to replicate from, NULL on a primary
+    const char *cluster;        // member list of the sharded cluster, or NULL
+    int shard_self;             // this registry's index in cluster
+    int idle_timeout;           // seconds a silent peer stays connected, 0 for ever
+    int request_timeout;        // seconds a request may stay incomplete
+    int uring;                  // drive the sockets with io_uring instead of the reactor
 };
 
-// peer_count and struct peers[MAX_PEERS]
-int find_peer_by_socket(int socket_fd, int peer_count, struct peer_entry *peers);
-int find_peer_with_file(const char *filename, int peer_count, struct peer_entry *peers);
-void remove_peer(int socket_fd, int *peer_count, struct peer_entry *peers);
-void handle_join(int sockfd, uint32_t peer_id, int *peer_count, struct peer_entry *peers, struct sockaddr *peer_addr);
-void handle_publish(int sockfd, char *buf, int msg_len, int peer_count, struct peer_entry *peers);
-void handle_search(int sockfd, char *buf, int peer_count, struct peer_entry *peers);
+// Each worker owns a listening socket (sharded with SO_REUSEPORT when there is
+// more than one worker), an event loop and the connections it accepted. The
+// registry is shared by all workers.
+struct worker {
+    int id;
+    pthread_t thread;
+    int listen_socket;
+    struct reactor reactor;
+    struct uring ring;          // replaces the reactor with -u
+    uint32_t uring_ids;         // last uring_id given to an accepted socket
+    struct conn_table conns;
+    struct registry *registry;
+    const struct options *opts;
+    struct metrics metrics;
+    struct timer_wheel timers;  // connection timeouts
+    struct timer ghost_timer;   // worker 0 drops unclaimed ghosts when it fires
+    int takeover_fd;            // a replica's worker 0: readable once the primary is lost, else -1
+    uint64_t now;               // ns, when the last wait returned
+};
+
+// Background thread writing periodic snapshots
+struct snapshotter {
+    pthread_t thread;
+    struct registry *registry;
+    const struct options *opts;
+};
+
+// Background thread of a replica applying its primary's stream
+struct follower {
+    pthread_t thread;
+    struct registry *registry;
+    const struct options *opts;
+    int socket;
+    int takeover_fd;            // eventfd telling worker 0 to start the ghost grace period
+};
+
+int bind_and_listen( const char *service, int reuseport );
+void usage(const char *prog);
+
+void handle_join(int sockfd, uint32_t peer_id, struct registry *reg, struct sockaddr_storage *peer_addr);
+void handle_publish(int sockfd, char *buf, int msg_len, struct registry *reg);
+void handle_publish_delta(int sockfd, unsigned char *buf, size_t msg_len, struct registry *reg);
+void handle_version(struct conn *c, struct registry *reg);
+void handle_search(struct conn *c, char *buf, struct registry *reg);
+void handle_msearch(struct conn *c, unsigned char *buf, size_t msg_len, struct registry *reg);
+void handle_searchk(struct conn *c, unsigned char *buf, struct registry *reg);
+void handle_find(struct conn *c, unsigned char *buf, struct registry *reg);
+void handle_stats(struct conn *c);
+void handle_replicate(struct worker *w, struct conn *c);
+void handle_cluster(struct conn *c, struct registry *reg);
+int owns_name(const struct registry *reg, const char *name);
+void pack_search_record(unsigned char *rec, const struct holder *h);
+
+int restore_registry(struct registry *reg, const struct options *opts, struct wal *wal);
+void *snapshot_run(void *arg);
+int connect_primary(const char *primary);
+void *follow_run(void *arg);
+
+// event loop helpers
+void *worker_run(void *arg);
+void accept_connections(struct worker *w);
+void start_connection(struct worker *w, struct conn *c);
+void handle_readable(struct worker *w, struct conn *c);
+void handle_writable(struct worker *w, struct conn *c);
+void process_input(struct worker *w, struct conn *c);
+void track_partial_request(struct worker *w, struct conn *c);
+int flush_output(struct worker *w, struct conn *c);
+void dispatch_request(struct worker *w, struct conn *c, unsigned char *frame, size_t len);
+void close_connection(struct worker *w, struct conn *c);
+void detach_connection(struct worker *w, struct conn *c);
+void expire_restored_peers(struct timer *t, void *arg);
+void take_over(struct worker *w);
+uint64_t conn_deadline(const struct worker *w, const struct conn *c);
+void conn_timer_fire(struct timer *t, void *arg);
+void handle_ping(struct conn *c);
+
+// io_uring event loop
+void *uring_worker_run(void *arg);
+void uring_handle_completion(struct worker *w, const struct io_uring_cqe *cqe);
+void uring_accepted(struct worker *w, const struct io_uring_cqe *cqe);
+void uring_received(struct worker *w, struct conn *c, const struct io_uring_cqe *cqe);
+void uring_sent(struct worker *w, struct conn *c, const struct io_uring_cqe *cqe);
+int uring_process(struct worker *w, struct conn *c);
+int uring_arm_accept(struct worker *w);
+int uring_arm_takeover(struct worker *w);
+int uring_arm_recv(struct worker *w, struct conn *c);
+int uring_send(struct worker *w, struct conn *c);
+int uring_cancel(struct worker *w, struct conn *c, int everything);
+void uring_release(struct worker *w, struct conn *c);
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-o output_high_water] [-l debug|info|warn|error] [-s sample]\n"
+        "          [-S snapshot_file [-i snapshot_seconds]] [-W log_file] [-g ghost_grace_seconds]\n"
+        "          [-F primary_host:port] [-C host:port,host:port,... -I member_index]\n"
+        "          [-t idle_seconds] [-T request_seconds] [-u]\n"
+        "          <port> [workers]\n", prog);
+    exit(1);
+}
 
 // Main function initializes server and handles client communication
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(1);
-    }
-
-	struct peer_entry peers[MAX_PEERS];
-	int peer_count = 0;
-    
-	// all_sockets stores all active sockets. Any socket connected to the server should
-	// be included in the set. A socket that disconnects should be removed from the set.
-	// The server's main socket should always remain in the set.
-	fd_set all_sockets;
-	FD_ZERO(&all_sockets);
-	// call_set is a temporary used for each select call. Sockets will get removed from
-	// the set by select to indicate each socket's availability.
-	fd_set call_set;
-	FD_ZERO(&call_set);
-
-	// listen_socket is the fd on which the program can accept() new connections
-	int listen_socket = bind_and_listen(argv[1]);
-	FD_SET(listen_socket, &all_sockets);
-
-	// max_socket should always contain the socket fd with the largest value, just one
-	// for now.
-	int max_socket = listen_socket;
+    struct options opts;
+    opts.workers = 1;
+    opts.out_high_water = DEFAULT_OUT_HIGH_WATER;
+    opts.log_level = LOG_DEBUG;
+    opts.log_sample = 1;
+    opts.snapshot_path = NULL;
+    opts.snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+    opts.ghost_grace = DEFAULT_GHOST_GRACE;
+    opts.wal_path = NULL;
+    opts.primary = NULL;
+    opts.cluster = NULL;
+    opts.shard_self = -1;
+    opts.idle_timeout = 0;
+    opts.request_timeout = DEFAULT_REQUEST_TIMEOUT;
+    opts.uring = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:l:s:S:i:g:W:F:C:I:t:T:u")) != -1) {
+        switch (opt) {
+        case 'o':
+            opts.out_high_water = strtoul(optarg, NULL, 10);
+            if (opts.out_high_water == 0) {
+                fprintf(stderr, "-o needs a byte count greater than 0\n");
+                exit(1);
+            }
+            break;
+        case 'l':
+            opts.log_level = logger_level(optarg);
+            if (opts.log_level == -1)
+                usage(argv[0]);
+            break;
+        case 's':
+            opts.log_sample = strtoul(optarg, NULL, 10);
+            if (opts.log_sample == 0) {
+                fprintf(stderr, "-s needs a sample rate of 1 or more\n");
+                exit(1);
+            }
+            break;
+        case 'S':
+            opts.snapshot_path = optarg;
+            break;
+        case 'i':
+            opts.snapshot_interval = atoi(optarg);
+            if (opts.snapshot_interval < 1) {
+                fprintf(stderr, "-i needs at least 1 second\n");
+                exit(1);
+            }
+            break;
+        case 'g':
+            opts.ghost_grace = atoi(optarg);
+            if (opts.ghost_grace < 0) {
+                fprintf(stderr, "-g needs 0 or more seconds\n");
+                exit(1);
+            }
+            break;
+        case 'W':
+            opts.wal_path = optarg;
+            break;
+        case 'F':
+            opts.primary = optarg;
+            break;
+        case 'C':
+            opts.cluster = optarg;
+            break;
+        case 'I':
+            opts.shard_self = atoi(optarg);
+            break;
+        case 't':
+            opts.idle_timeout = atoi(optarg);
+            if (opts.idle_timeout < 0)
+                usage(argv[0]);
+            break;
+        case 'T':
+            opts.request_timeout = atoi(optarg);
+            if (opts.request_timeout < 1)
+                usage(argv[0]);
+            break;
+        case 'u':
+            opts.uring = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 1 && argc - optind != 2)
+        usage(argv[0]);
+    opts.port = argv[optind];
+
+    if (argc - optind == 2) {
+        opts.workers = atoi(argv[optind + 1]);
+        if (opts.workers < 1 || opts.workers > MAX_WORKERS) {
+            fprintf(stderr, "workers must be between 1 and %d\n", MAX_WORKERS);
+            exit(1);
+        }
+    }
+    int worker_count = opts.workers;
+
+	// A peer that hangs up with replies still queued must cost only its own
+	// connection: writev() can't take MSG_NOSIGNAL, so EPIPE has to come
+	// back as an error instead of a signal that kills every worker
+	signal(SIGPIPE, SIG_IGN);
+
+	// Request logging goes through a background thread so a slow stdout
+	// can't stall the event loops
+	if (logger_init(opts.log_level, opts.log_sample) == -1) {
+		fprintf(stderr, "ERROR starting logger\n");
+		return -1;
+	}
+
+	struct registry registry;
+	if (registry_init(&registry) == -1) {
+		fprintf(stderr, "ERROR initializing registry\n");
+		return -1;
+	}
+
+	// As one shard of a cluster the registry keeps only the names it owns
+	struct shard_ring ring;
+	if (opts.cluster != NULL) {
+		if (shard_ring_init(&ring, opts.cluster) == -1) {
+			fprintf(stderr, "-C needs a list of host:port members\n");
+			return -1;
+		}
+		if (opts.shard_self < 0 || opts.shard_self >= ring.member_count) {
+			fprintf(stderr, "-I needs this registry's index in the -C list, 0 to %d\n", ring.member_count - 1);
+			return -1;
+		}
+		registry.shards = &ring;
+		registry.shard_self = opts.shard_self;
+	}
+	struct wal wal;
+	if (restore_registry(&registry, &opts, &wal) == -1)
+		return -1;
+
+	struct worker *workers = calloc(worker_count, sizeof *workers);
+	if (workers == NULL) {
+		perror("ERROR allocating workers");
+		return -1;
+	}
+
+	// Every worker binds its own listening socket so the kernel spreads new
+	// connections across them. All listeners are opened before any thread
+	// starts so a bad port fails right away.
+	for (int i = 0; i < worker_count; i++) {
+		struct worker *w = &workers[i];
+		w->id = i;
+		w->registry = &registry;
+		w->opts = &opts;
+		conn_table_init(&w->conns);
+		metrics_register(&w->metrics);
+		w->now = metrics_now();
+		timer_wheel_init(&w->timers, w->now);
+		timer_init(&w->ghost_timer, expire_restored_peers);
+		w->takeover_fd = -1;
+
+		// listen_socket is the fd on which the worker can accept() new connections
+		w->listen_socket = bind_and_listen(opts.port, worker_count > 1);
+		if (w->listen_socket == -1)
+			return -1;
+		if (opts.uring)
+			continue;
+		if (reactor_init(&w->reactor) == -1 || set_nonblocking(w->listen_socket) == -1 ||
+		    reactor_add(&w->reactor, w->listen_socket, REACTOR_READ) == -1) {
+			perror("ERROR registering listen socket");
+			return -1;
+		}
+	}
+
+	// Each worker sets up its own ring, as only the thread that creates
+	// one may submit to it; a trial ring here fails early on old kernels
+	if (opts.uring) {
+		struct uring probe;
+		if (uring_init(&probe, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) == -1) {
+			perror("ERROR setting up io_uring");
+			return -1;
+		}
+		uring_close(&probe);
+	}
+
+	if (opts.primary == NULL && registry.ghost_count > 0)
+		timer_schedule(&workers[0].timers, &workers[0].ghost_timer,
+			metrics_now() + (uint64_t)opts.ghost_grace * 1000000000u);
+
+	// A replica starts out read-only, filled by its primary's stream
+	struct follower follower = { 0, &registry, &opts, -1, -1 };
+	if (opts.primary != NULL) {
+		follower.socket = connect_primary(opts.primary);
+		if (follower.socket == -1)
+			return -1;
+		// worker 0 owns the ghost timer, so the follower wakes it to take over
+		follower.takeover_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (follower.takeover_fd == -1 ||
+		    (!opts.uring && reactor_add(&workers[0].reactor, follower.takeover_fd, REACTOR_READ) == -1)) {
+			perror("ERROR setting up takeover");
+			return -1;
+		}
+		workers[0].takeover_fd = follower.takeover_fd;
+		registry.read_only = 1;
+		if (pthread_create(&follower.thread, NULL, follow_run, &follower) != 0) {
+			fprintf(stderr, "ERROR starting replication thread\n");
+			return -1;
+		}
+	}
+
+	struct snapshotter snapshotter = { 0, &registry, &opts };
+	if (opts.snapshot_path != NULL &&
+	    pthread_create(&snapshotter.thread, NULL, snapshot_run, &snapshotter) != 0) {
+		fprintf(stderr, "ERROR starting snapshot thread\n");
+		return -1;
+	}
+
+	// Worker 0 runs on the main thread
+	void *(*run)(void *) = opts.uring ? uring_worker_run : worker_run;
+	for (int i = 1; i < worker_count; i++) {
+		if (pthread_create(&workers[i].thread, NULL, run, &workers[i]) != 0) {
+			fprintf(stderr, "ERROR starting worker %d\n", i);
+			return -1;
+		}
+	}
+	run(&workers[0]);
+
+	for (int i = 1; i < worker_count; i++)
+		pthread_join(workers[i].thread, NULL);
+	free(workers);
+	wal_close(registry.wal);
+	registry_destroy(&registry);
+	logger_shutdown();
+    return 0;
+}
+
+// Warm restart: restores the registry from the snapshot file, then replays
+// the write-ahead log on top of it, and opens the log for appending (with no
+// file when there is no -W, to feed replicas). A replica skips the restore,
+// as its primary sends everything. Returns -1 if the registry can't start.
+int restore_registry(struct registry *reg, const struct options *opts, struct wal *wal) {
+	struct snapshot_stats stats;
+	stats.wal_lsn = 0;
+	uint64_t start = metrics_now();
+	if (opts->snapshot_path != NULL && opts->primary == NULL) {
+		if (snapshot_load(reg, opts->snapshot_path, &stats) == -1) {
+			if (errno == EINVAL) {
+				// a bad snapshot is no worse than none; peers will re-publish
+				fprintf(stderr, "WARNING ignoring corrupt snapshot %s\n", opts->snapshot_path);
+			} else if (errno != ENOENT) {
+				perror("ERROR loading snapshot");
+				return -1;
+			}
+			stats.wal_lsn = 0;
+		} else {
+			log_printf(LOG_DEBUG, "[DEBUG] Restored %u peers, %u files, %u names from %s in %llu ms\n",
+				stats.peers, stats.files, stats.names, opts->snapshot_path,
+				(unsigned long long)((metrics_now() - start) / 1000000));
+		}
+	}
+
+	uint64_t end_lsn = stats.wal_lsn;
+	if (opts->wal_path != NULL && opts->primary == NULL) {
+		start = metrics_now();
+		long replayed = wal_replay(reg, opts->wal_path, stats.wal_lsn, &end_lsn);
+		if (replayed == -1) {
+			fprintf(stderr, "ERROR replaying log %s: %s\n", opts->wal_path, strerror(errno));
+			return -1;
+		}
+		log_printf(LOG_DEBUG, "[DEBUG] Replayed %ld log records from %s in %llu ms\n",
+			replayed, opts->wal_path, (unsigned long long)((metrics_now() - start) / 1000000));
+	}
+	if (wal_open(wal, opts->wal_path, end_lsn) == -1) {
+		fprintf(stderr, "ERROR opening log %s: %s\n", opts->wal_path ? opts->wal_path : "", strerror(errno));
+		return -1;
+	}
+	reg->wal = wal;
+	return 0;
+}
+
+// Writes a snapshot every snapshot_interval seconds
+void *snapshot_run(void *arg) {
+	struct snapshotter *s = arg;
+	while (1) {
+		sleep(s->opts->snapshot_interval);
+		struct snapshot_stats stats;
+		uint64_t start = metrics_now();
+		if (snapshot_write(s->registry, s->opts->snapshot_path, &stats) == -1) {
+			log_printf(LOG_WARN, "[WARN] Snapshot to %s failed: %s\n", s->opts->snapshot_path, strerror(errno));
+			continue;
+		}
+		// the snapshot is on disk, so the log no longer needs what it covers
+		wal_compact(s->registry->wal, stats.wal_lsn);
+		log_printf(LOG_DEBUG, "[DEBUG] Snapshot of %u peers, %u files: %llu bytes in %llu ms\n",
+			stats.peers, stats.files, (unsigned long long)stats.bytes,
+			(unsigned long long)((metrics_now() - start) / 1000000));
+	}
+	return NULL;
+}
+
+// Connects to the primary at host:port and asks it for its stream.
+// Returns the socket, or -1.
+int connect_primary(const char *primary) {
+	char host[256];
+	const char *colon = strrchr(primary, ':');
+	if (colon == NULL || colon == primary || colon - primary >= (int)sizeof host) {
+		fprintf(stderr, "-F needs host:port\n");
+		return -1;
+	}
+	memcpy(host, primary, colon - primary);
+	host[colon - primary] = '\0';
+
+	struct addrinfo hints, *result, *rp;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int rc = getaddrinfo(host, colon + 1, &hints, &result);
+	if (rc != 0) {
+		fprintf(stderr, "ERROR resolving primary %s: %s\n", primary, gai_strerror(rc));
+		return -1;
+	}
+	int s = -1;
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (s == -1)
+			continue;
+		if (connect(s, rp->ai_addr, rp->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(result);
+
+	unsigned char cmd = CMD_REPLICATE;
+	if (s == -1 || send(s, &cmd, 1, MSG_NOSIGNAL) != 1) {
+		fprintf(stderr, "ERROR connecting to primary %s\n", primary);
+		if (s != -1)
+			close(s);
+		return -1;
+	}
+	return s;
+}
+
+// Applies the primary's stream until it ends, then takes over: the registry
+// accepts writes, and replicated peers get the usual grace period to re-JOIN
+// and adopt what the primary knew of them
+void *follow_run(void *arg) {
+	struct follower *f = arg;
+	struct registry *reg = f->registry;
+	unsigned char *buf = NULL;
+	size_t len = 0, capacity = 0;
+	while (1) {
+		if (capacity - len < 64 * 1024) {
+			size_t capacity_new = capacity ? capacity * 2 : 1024 * 1024;
+			unsigned char *p = realloc(buf, capacity_new);
+			if (p == NULL) {
+				log_printf(LOG_ERROR, "[ERROR] Out of memory replicating from %s\n", f->opts->primary);
+				break;
+			}
+			buf = p;
+			capacity = capacity_new;
+		}
+		ssize_t n = recv(f->socket, buf + len, capacity - len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+
+		// nothing takes effect before it is in this registry's own log
+		size_t used;
+		pthread_mutex_lock(&reg->write_lock);
+		int rc = wal_log_records(reg->wal, buf, len, &used);
+		pthread_mutex_unlock(&reg->write_lock);
+		if (rc == -1) {
+			log_printf(LOG_ERROR, "[ERROR] Corrupt stream from primary %s\n", f->opts->primary);
+			break;
+		}
+		// a failed log has been reported; like a primary, carry on without it
+		wal_sync(reg->wal);
+
+		pthread_mutex_lock(&reg->write_lock);
+		rc = wal_apply_records(reg, buf, used);
+		pthread_mutex_unlock(&reg->write_lock);
+		epoch_collect();
+		if (rc == -1) {
+			log_printf(LOG_ERROR, "[ERROR] Out of memory replicating from %s\n", f->opts->primary);
+			break;
+		}
+		memmove(buf, buf + used, len - used);
+		len -= used;
+	}
+	free(buf);
+	close(f->socket);
+
+	__atomic_store_n(&reg->read_only, 0, __ATOMIC_RELEASE);
+	log_printf(LOG_WARN, "[WARN] Lost primary %s, taking over\n", f->opts->primary);
+
+	uint64_t one = 1;
+	if (write(f->takeover_fd, &one, sizeof one) != sizeof one)
+		log_printf(LOG_ERROR, "[ERROR] Waking worker to take over: %s\n", strerror(errno));
+	return NULL;
+}
+
+// Starts the grace period for the peers replicated from a lost primary,
+// on the worker that owns the ghost timer
+void take_over(struct worker *w) {
+	uint64_t n;
+	metrics_add(&w->metrics.syscalls, 1);
+	if (read(w->takeover_fd, &n, sizeof n) != sizeof n)
+		return;
+	timer_schedule(&w->timers, &w->ghost_timer, w->now + (uint64_t)w->opts->ghost_grace * 1000000000u);
+}
+
+// Drops the restored peers that didn't re-JOIN in time
+void expire_restored_peers(struct timer *t, void *arg) {
+	struct worker *w = arg;
+	(void)t;
+	pthread_mutex_lock(&w->registry->write_lock);
+	int expired = w->registry->ghost_count;
+	expire_ghosts(w->registry);
+	pthread_mutex_unlock(&w->registry->write_lock);
+	epoch_collect();
+	log_printf(LOG_DEBUG, "[DEBUG] Dropped %d restored peers that did not re-join\n", expired);
+}
+
+// Event loop of a single worker
+void *worker_run(void *arg) {
+    struct worker *w = arg;
+	struct reactor_event events[MAX_EVENTS];
 
     // Main server loop
     while (1) {
-        call_set = all_sockets;
-        struct sockaddr_storage remoteaddr;
-		socklen_t addrlen = sizeof remoteaddr;
-		int num_s = select(max_socket+1, &call_set, NULL, NULL, NULL);
+		int timeout = timer_next_ms(&w->timers, metrics_now());
+		int num_s = reactor_wait(&w->reactor, events, MAX_EVENTS, timeout);
+		metrics_add(&w->metrics.syscalls, 1);
+		w->now = metrics_now();
+		timer_advance(&w->timers, w->now, w);
 		if( num_s < 0 ){
-			perror("ERROR in select() call");
-			return -1;
-		}
-		// Check each potential socket.
-		// Skip standard IN/OUT/ERROR -> start at 3.
-		for( int s = 0; s <= max_socket; ++s ){
-			// Skip sockets that aren't ready
-			if( !FD_ISSET(s, &call_set) )
+			if (errno == EINTR)
 				continue;
+			perror("ERROR waiting for events");
+			break;
+		}
+		metrics_add(&w->metrics.wakeups, 1);
+		histogram_record(&w->metrics.ready_fds, num_s);
+		// Only sockets that are ready are reported
+		for( int i = 0; i < num_s; ++i ){
+			int s = events[i].fd;
 
-			// A new connection is ready
-			if( s == listen_socket ){
-				// What should happen with a new connection?
-				// You need to call at least one function here
-				// and update some variables.
-				int newsock = accept(listen_socket, (struct sockaddr*)&remoteaddr, &addrlen);
-				FD_SET(newsock, &all_sockets);
-				max_socket = find_max_fd(&all_sockets);
+			// New connections are ready
+			if( s == w->listen_socket ){
+				accept_connections(w);
+			}
+			else if( s == w->takeover_fd ){
+				take_over(w);
 			}
 
-			// A connected socket is ready
+			// A connected socket is ready. Writing first frees output space
+			// for requests the read may decode. Either step can close the
+			// connection, so look it up again in between.
 			else{
-				// Put your code here for connected sockets.
-				// Don't forget to handle a closed socket, which will
-				// end up here as well.
-				char buf[MAX_BUF_SIZE];
-				int bytes_received = recv(s, buf, sizeof buf, 0);
-
-                // EVERYTHING BELOW HERE SHOULD BE CHECKED
-                if (bytes_received <= 0) {
-                    remove_peer(s, &peer_count, peers);
-                    FD_CLR(s, &all_sockets);
-                    close(s);
-                } else {
-                    if (bytes_received < MAX_BUF_SIZE)
-                        buf[bytes_received] = '\0';
-                    else
-                        buf[MAX_BUF_SIZE - 1] = '\0';
-
-                     // Dispatch request based on command
-                    
-                    unsigned char cmd = buf[0];
-                    switch (cmd) {
-                    case 0x00:  // JOIN
-                        if (bytes_received >= 5) {                            
-                            uint32_t peer_id;
-                            memcpy(&peer_id, buf + 1, sizeof(uint32_t));
-                            handle_join(s, ntohl(peer_id), &peer_count, peers, (struct sockaddr *)&remoteaddr);
-                        }
-                        break;
-
-                    case 0x01:  // PUBLISH
-                        if (bytes_received >= 2) {                           
-                            handle_publish(s, buf, bytes_received, peer_count, peers);
-                        }
-                        break;
-
-                    case 0x02:  // SEARCH
-                        if (bytes_received >= 2) {                    
-                            handle_search(s, buf, peer_count, peers);
-                        }
-                        break;
-
-                    default:
-                        printf("[DEBUG] Unknown command byte: 0x%02X\n", cmd);
-                    }
-                }
-
+				struct conn *c = conn_find(&w->conns, s);
+				if (c != NULL && (events[i].events & REACTOR_WRITE))
+					handle_writable(w, c);
+				c = conn_find(&w->conns, s);
+				if (c != NULL && (events[i].events & REACTOR_READ))
+					handle_readable(w, c);
 			}
 		}
     }
-    close(listen_socket);
+    reactor_close(&w->reactor);
+    conn_table_free(&w->conns);
+    close(w->listen_socket);
+    return NULL;
+}
+
+// Accepts every pending connection; the listen socket is edge-triggered so
+// it has to be drained until accept() would block
+void accept_connections(struct worker *w) {
+    while (1) {
+        struct sockaddr_storage remoteaddr;
+        socklen_t addrlen = sizeof remoteaddr;
+        int newsock = accept(w->listen_socket, (struct sockaddr*)&remoteaddr, &addrlen);
+        metrics_add(&w->metrics.syscalls, 1);
+        if (newsock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("ERROR in accept() call");
+            return;
+        }
+
+        metrics_add(&w->metrics.syscalls, 3);
+        if (set_nonblocking(newsock) == -1 ||
+            conn_open(&w->conns, newsock, &remoteaddr, addrlen) == NULL) {
+            close(newsock);
+            continue;
+        }
+        if (reactor_add(&w->reactor, newsock, REACTOR_READ) == -1) {
+            perror("ERROR watching new connection");
+            conn_release(&w->conns, newsock);
+            close(newsock);
+            continue;
+        }
+        struct conn *c = conn_find(&w->conns, newsock);
+        c->events = REACTOR_READ;
+        start_connection(w, c);
+    }
+}
+
+// Sets up what every new connection gets, whichever loop accepted it
+void start_connection(struct worker *w, struct conn *c) {
+    timer_init(&c->timer, conn_timer_fire);
+    c->last_active = w->now;
+    if (w->opts->idle_timeout > 0)
+        timer_schedule(&w->timers, &c->timer, conn_deadline(w, c));
+
+    // The kernel notices peers that vanished without a FIN, which the
+    // idle timeout (off by default) would otherwise have to catch
+    int on = 1;
+    setsockopt(c->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof on);
+    metrics_add(&w->metrics.syscalls, 1);
+#ifdef TCP_KEEPIDLE
+    int idle = 60, interval = 10, probes = 3;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof idle);
+    setsockopt(c->fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof interval);
+    setsockopt(c->fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof probes);
+    metrics_add(&w->metrics.syscalls, 3);
+#endif
+    metrics_add(&w->metrics.accepts, 1);
+}
+
+// Removes the peer on a connection and frees its state
+void close_connection(struct worker *w, struct conn *c) {
+    int s = c->fd;
+    pthread_mutex_lock(&w->registry->write_lock);
+    struct peer_entry *peer = find_peer_by_socket(s, w->registry);
+    if (peer != NULL)
+        wal_append(w->registry->wal, WAL_LEAVE, peer->id, NULL, 0);
+    remove_peer(s, w->registry);
+    pthread_mutex_unlock(&w->registry->write_lock);
+    epoch_collect();
+
+    timer_cancel(&w->timers, &c->timer);
+    if (w->opts->uring) {
+        uring_release(w, c);
+        return;
+    }
+    reactor_del(&w->reactor, s);
+    conn_release(&w->conns, s);
+    close(s);
+    metrics_add(&w->metrics.syscalls, 2);
+}
+
+// Lets go of a connection another thread now owns, without closing it
+void detach_connection(struct worker *w, struct conn *c) {
+    int s = c->fd;
+    timer_cancel(&w->timers, &c->timer);
+    if (w->opts->uring) {
+        // the multishot recv must stop before the new owner reads
+        uring_cancel(w, c, 0);
+        uring_enter(&w->ring, 0);
+    } else {
+        reactor_del(&w->reactor, s);
+        metrics_add(&w->metrics.syscalls, 1);
+    }
+    conn_release(&w->conns, s);
+}
+
+// When a connection times out: idle_timeout after its last bytes, or
+// request_timeout after a request started arriving without finishing.
+// 0 if neither applies.
+uint64_t conn_deadline(const struct worker *w, const struct conn *c) {
+    uint64_t deadline = 0;
+    if (w->opts->idle_timeout > 0)
+        deadline = c->last_active + (uint64_t)w->opts->idle_timeout * 1000000000u;
+    if (c->partial_since != 0) {
+        uint64_t stalled = c->partial_since + (uint64_t)w->opts->request_timeout * 1000000000u;
+        if (deadline == 0 || stalled < deadline)
+            deadline = stalled;
+    }
+    return deadline;
+}
+
+// A connection's timer only moves when it fires: traffic just updates
+// last_active, and a timer that fires early is pushed to the new deadline
+void conn_timer_fire(struct timer *t, void *arg) {
+    struct worker *w = arg;
+    struct conn *c = (struct conn *)((char *)t - offsetof(struct conn, timer));
+    uint64_t deadline = conn_deadline(w, c);
+    if (deadline == 0)
+        return;
+    if (deadline > w->now) {
+        timer_schedule(&w->timers, t, deadline);
+        return;
+    }
+    metrics_add(&w->metrics.timeouts, 1);
+    log_printf(LOG_DEBUG, "[DEBUG] %s timeout, closing socket %d\n",
+        c->partial_since != 0 ? "Request" : "Idle", c->fd);
+    close_connection(w, c);
+}
+
+// Reads everything available on a connection and handles every complete
+// request in it. A request split across reads stays buffered until the rest
+// arrives, and several pipelined requests in one read are all handled. The
+// responses are sent together once reading stops.
+void handle_readable(struct worker *w, struct conn *c) {
+    while (1) {
+        process_input(w, c);
+        if (c->detached) {
+            detach_connection(w, c);
+            return;
+        }
+        if (c->reading_paused) {
+            // Send what we can; if the peer isn't reading its responses,
+            // leave the rest of its requests in the socket until it does
+            if (flush_output(w, c) == -1 || c->out_bytes > w->opts->out_high_water / 2)
+                return;
+            c->reading_paused = 0;
+            continue;
+        }
+
+        size_t avail;
+        unsigned char *space = conn_in_reserve(c, 1, MAX_FRAME_SIZE, &avail);
+        if (space == NULL) {
+            log_printf(LOG_DEBUG, "[DEBUG] Request too large, closing socket %d\n", c->fd);
+            close_connection(w, c);
+            return;
+        }
+
+        ssize_t bytes_received = recv(c->fd, space, avail, 0);
+        metrics_add(&w->metrics.syscalls, 1);
+        if (bytes_received < 0 && errno == EINTR)
+            continue;
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (bytes_received <= 0) {
+            close_connection(w, c);
+            return;
+        }
+        c->in_end += bytes_received;
+        c->last_active = w->now;
+        metrics_add(&w->metrics.bytes_in, bytes_received);
+    }
+    track_partial_request(w, c);
+    flush_output(w, c);
+}
+
+// Whatever is left over in the input buffer is the start of a request still
+// arriving, which has request_timeout to complete
+void track_partial_request(struct worker *w, struct conn *c) {
+    if (c->in_start < c->in_end) {
+        if (c->partial_since == 0)
+            c->partial_since = w->now;
+        uint64_t deadline = conn_deadline(w, c);
+        if (!timer_pending(&c->timer) || c->timer.expires * TIMER_TICK_NS > deadline)
+            timer_schedule(&w->timers, &c->timer, deadline);
+    } else {
+        c->partial_since = 0;
+    }
+}
+
+// Sends queued output and picks up reading again once the backlog has
+// drained to half the high-water mark
+void handle_writable(struct worker *w, struct conn *c) {
+    if (flush_output(w, c) == -1)
+        return;
+    if (c->reading_paused && c->out_bytes <= w->opts->out_high_water / 2) {
+        c->reading_paused = 0;
+        handle_readable(w, c);
+    }
+}
+
+// Handles the complete requests in the input buffer, stopping early if the
+// connection's output is over the high-water mark
+void process_input(struct worker *w, struct conn *c) {
+    while (c->in_start < c->in_end) {
+        if (c->out_bytes >= w->opts->out_high_water) {
+            c->reading_paused = 1;
+            return;
+        }
+
+        size_t frame_len;
+        unsigned char *frame = c->in_buf + c->in_start;
+        int rc = frame_decode(frame, c->in_end - c->in_start, &frame_len, &c->scan);
+        if (rc == FRAME_PARTIAL)
+            return;
+        if (rc == FRAME_ERROR) {
+            // There is no way to find the next request boundary, so the
+            // rest of what was received is dropped
+            log_printf(LOG_DEBUG, "[DEBUG] Unknown command byte: 0x%02X\n", frame[0]);
+            conn_in_consume(c, c->in_end - c->in_start);
+            return;
+        }
+        dispatch_request(w, c, frame, frame_len);
+        if (c->detached)
+            return;
+        conn_in_consume(c, frame_len);
+    }
+}
+
+// Writes queued output and watches for writability only while some is left.
+// Returns -1 if the connection failed and was closed.
+// With io_uring it only starts a send, whose completion sends the rest.
+int flush_output(struct worker *w, struct conn *c) {
+    if (w->opts->uring) {
+        if (c->send_inflight || c->out_bytes == 0)
+            return 0;
+        return uring_send(w, c);
+    }
+
+    size_t queued = c->out_bytes;
+    if (queued > 0)
+        metrics_add(&w->metrics.syscalls, 1);
+    if (conn_flush(c) == -1) {
+        close_connection(w, c);
+        return -1;
+    }
+    metrics_add(&w->metrics.bytes_out, queued - c->out_bytes);
+    int want = REACTOR_READ | (c->out_bytes > 0 ? REACTOR_WRITE : 0);
+    if (want != c->events && reactor_mod(&w->reactor, c->fd, want) == 0) {
+        c->events = want;
+        metrics_add(&w->metrics.syscalls, 1);
+    }
     return 0;
 }
 
-// Finds the index of a peer based on its socket FD
-int find_peer_by_socket(int socket_fd, int peer_count, struct peer_entry *peers) {
-    for (int i = 0; i < peer_count; i++) {
-        if (peers[i].socket_fd == socket_fd)
-            return i;
+// Event loop of a worker driven by io_uring. A multishot accept and a
+// multishot recv per connection stay armed, so the loop makes no system
+// call per request: replies go out as sends queued on the ring, and all
+// requests queued while handling a batch of completions are submitted by
+// the same io_uring_enter() that waits for the next batch.
+void *uring_worker_run(void *arg) {
+    struct worker *w = arg;
+    if (uring_init(&w->ring, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) == -1) {
+        perror("ERROR setting up io_uring");
+        return NULL;
     }
-    return -1;
+    if (uring_arm_accept(w) == -1 || (w->takeover_fd != -1 && uring_arm_takeover(w) == -1))
+        return NULL;
+
+    uint64_t counted = 0;
+    while (1) {
+        int timeout = timer_next_ms(&w->timers, metrics_now());
+        int rc = uring_enter(&w->ring, timeout);
+        w->now = metrics_now();
+        timer_advance(&w->timers, w->now, w);
+        if (rc == -1 && errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+            perror("ERROR waiting for completions");
+            break;
+        }
+        metrics_add(&w->metrics.wakeups, 1);
+
+        int completions = 0;
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&w->ring)) != NULL) {
+            struct io_uring_cqe done = *cqe;
+            uring_seen(&w->ring);
+            uring_handle_completion(w, &done);
+            completions++;
+        }
+        histogram_record(&w->metrics.ready_fds, completions);
+        metrics_add(&w->metrics.syscalls, w->ring.enters - counted);
+        counted = w->ring.enters;
+    }
+    uring_close(&w->ring);
+    conn_table_free(&w->conns);
+    close(w->listen_socket);
+    return NULL;
 }
 
-// Finds a peer that has the requested file
-int find_peer_with_file(const char *filename, int peer_count, struct peer_entry *peers) {
-    for (int i = 0; i < peer_count; i++) {
-        for (int j = 0; j < peers[i].file_count; j++) {
-            if (strcmp(peers[i].files[j], filename) == 0) {
-                return i;
-            }
+void uring_handle_completion(struct worker *w, const struct io_uring_cqe *cqe) {
+    int op = cqe->user_data >> 56;
+    uint32_t id = (cqe->user_data >> 32) & 0xffffff;
+    int fd = (int)(uint32_t)cqe->user_data;
+    if (op == UOP_ACCEPT) {
+        uring_accepted(w, cqe);
+        return;
+    }
+    if (op == UOP_TAKEOVER) {
+        take_over(w);
+        return;
+    }
+    if (op != UOP_RECV && op != UOP_SEND)
+        return;     // cancels and closes need nothing more
+
+    struct conn *c = conn_find(&w->conns, fd);
+    if (c == NULL || c->uring_id != id) {
+        // the socket was handed off; only the buffer needs giving back
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            uring_recycle(&w->ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        return;
+    }
+    if (op == UOP_RECV)
+        uring_received(w, c, cqe);
+    else
+        uring_sent(w, c, cqe);
+}
+
+int uring_arm_accept(struct worker *w) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL) {
+        perror("ERROR queueing accept");
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->listen_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_DATA(UOP_ACCEPT, 0, w->listen_socket);
+    return 0;
+}
+
+// Waits for the follower to signal a lost primary, see take_over()
+int uring_arm_takeover(struct worker *w) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL) {
+        perror("ERROR queueing takeover poll");
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = w->takeover_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_DATA(UOP_TAKEOVER, 0, w->takeover_fd);
+    return 0;
+}
+
+void uring_accepted(struct worker *w, const struct io_uring_cqe *cqe) {
+    // the kernel ends a multishot request after an error
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uring_arm_accept(w);
+    if (cqe->res < 0) {
+        if (cqe->res != -ECONNABORTED && cqe->res != -EINTR)
+            fprintf(stderr, "ERROR in accept: %s\n", strerror(-cqe->res));
+        return;
+    }
+
+    // a multishot accept has nowhere to put each peer's address
+    int newsock = cqe->res;
+    struct sockaddr_storage remoteaddr;
+    socklen_t addrlen = sizeof remoteaddr;
+    metrics_add(&w->metrics.syscalls, 1);
+    if (getpeername(newsock, (struct sockaddr *)&remoteaddr, &addrlen) == -1 ||
+        conn_open(&w->conns, newsock, &remoteaddr, addrlen) == NULL) {
+        close(newsock);
+        return;
+    }
+    struct conn *c = conn_find(&w->conns, newsock);
+    c->uring_id = ++w->uring_ids & 0xffffff;
+    start_connection(w, c);
+    if (uring_arm_recv(w, c) == -1)
+        close_connection(w, c);
+}
+
+// The recv picks a provided buffer for every completion it posts
+int uring_arm_recv(struct worker *w, struct conn *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = URING_DATA(UOP_RECV, c->uring_id, c->fd);
+    c->recv_armed = 1;
+    return 0;
+}
+
+// Copies what a recv delivered into the input buffer and handles it like
+// handle_readable(). A multishot recv that ended, because the kernel ran
+// out of buffers or it was cancelled, is armed again unless reading is
+// paused.
+void uring_received(struct worker *w, struct conn *c, const struct io_uring_cqe *cqe) {
+    int buffer = cqe->flags & IORING_CQE_F_BUFFER ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        c->recv_armed = 0;
+
+    if (c->closing || cqe->res <= 0) {
+        if (buffer != -1)
+            uring_recycle(&w->ring, buffer);
+        if (c->closing) {
+            uring_release(w, c);
+            return;
+        }
+        if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+            close_connection(w, c);
+            return;
+        }
+    } else {
+        size_t avail;
+        unsigned char *space = conn_in_reserve(c, cqe->res, MAX_FRAME_SIZE, &avail);
+        if (space == NULL) {
+            uring_recycle(&w->ring, buffer);
+            log_printf(LOG_DEBUG, "[DEBUG] Request too large, closing socket %d\n", c->fd);
+            close_connection(w, c);
+            return;
         }
+        memcpy(space, uring_buffer(&w->ring, buffer), cqe->res);
+        uring_recycle(&w->ring, buffer);
+        c->in_end += cqe->res;
+        c->last_active = w->now;
+        metrics_add(&w->metrics.bytes_in, cqe->res);
+        if (uring_process(w, c) == -1)
+            return;
     }
-    return -1;
+
+    if (!c->recv_armed && !c->reading_paused && uring_arm_recv(w, c) == -1)
+        close_connection(w, c);
 }
 
-// Removes a peer from the registry by socket FD
-void remove_peer(int socket_fd, int *peer_count, struct peer_entry *peers) {
-    int index = find_peer_by_socket(socket_fd, *peer_count, peers);
-    if (index != -1) {
-        close(peers[index].socket_fd);
-        peers[index] = peers[*peer_count - 1]; // isn't this creating a repeat of the peer before it?
-        (*peer_count)--;
-        // it seems like all this does is overwrite the value at the index
-        // then change the peer count so that we can't access the value in the final index
-        // This copies the last peer into the slot of the peer being removed, then reduces the peer count.
+// The rest of handle_readable() once bytes are in. A paused connection's
+// recv is cancelled, leaving further requests in the socket until the peer
+// reads its replies. Returns -1 if the connection was closed or handed off.
+int uring_process(struct worker *w, struct conn *c) {
+    process_input(w, c);
+    if (c->detached) {
+        detach_connection(w, c);
+        return -1;
+    }
+    track_partial_request(w, c);
+    if (flush_output(w, c) == -1)
+        return -1;
+    if (c->reading_paused && c->recv_armed && uring_cancel(w, c, 0) == -1) {
+        close_connection(w, c);
+        return -1;
     }
+    return 0;
 }
 
-// Handles a JOIN request from a peer
-void handle_join(int sockfd, uint32_t peer_id, int *peer_count, struct peer_entry *peers, struct sockaddr *peer_addr) {
-    if (*peer_count >= MAX_PEERS) return;
+// Sends the first chunk of queued output. conn_queue() only appends past
+// it, so the chunk stays put until the send completes.
+int uring_send(struct worker *w, struct conn *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL) {
+        close_connection(w, c);
+        return -1;
+    }
+    struct out_chunk *ch = c->out_head;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(ch->data + ch->start);
+    sqe->len = ch->end - ch->start;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_DATA(UOP_SEND, c->uring_id, c->fd);
+    c->send_inflight = 1;
+    return 0;
+}
 
-    int index = (*peer_count)++;
-    peers[index].id = peer_id;
-    peers[index].socket_fd = sockfd;
-    peers[index].file_count = 0;
-    memcpy(&peers[index].address, peer_addr, sizeof(struct sockaddr_storage));
+// Like handle_writable(): drops what went out, sends the rest and picks
+// reading back up once the backlog has drained to half the high-water mark
+void uring_sent(struct worker *w, struct conn *c, const struct io_uring_cqe *cqe) {
+    c->send_inflight = 0;
+    if (c->closing) {
+        uring_release(w, c);
+        return;
+    }
+    if (cqe->res < 0) {
+        close_connection(w, c);
+        return;
+    }
+    conn_out_consume(c, cqe->res);
+    metrics_add(&w->metrics.bytes_out, cqe->res);
+    if (c->reading_paused && c->out_bytes <= w->opts->out_high_water / 2) {
+        c->reading_paused = 0;
+        if (uring_process(w, c) == -1)
+            return;
+        if (!c->recv_armed && !c->reading_paused && uring_arm_recv(w, c) == -1) {
+            close_connection(w, c);
+            return;
+        }
+    }
+    flush_output(w, c);
+}
 
+// Cancels the connection's recv, or with everything set its send as well
+int uring_cancel(struct worker *w, struct conn *c, int everything) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    if (everything) {
+        sqe->fd = c->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    } else {
+        sqe->addr = URING_DATA(UOP_RECV, c->uring_id, c->fd);
+    }
+    sqe->user_data = URING_DATA(UOP_CANCEL, c->uring_id, c->fd);
+    return 0;
+}
 
-    socklen_t addrlen = sizeof(peers[index].address);
-    getpeername(sockfd, (struct sockaddr*)&peers[index].address, &addrlen);
+// The io_uring end of close_connection(). A send may still be reading the
+// output queue, so the state is freed and the socket closed only once the
+// connection's requests have completed; their completions call this again.
+void uring_release(struct worker *w, struct conn *c) {
+    if (!c->closing) {
+        c->closing = 1;
+        if ((c->recv_armed || c->send_inflight) && uring_cancel(w, c, 1) == -1) {
+            shutdown(c->fd, SHUT_RDWR);     // ends them just the same
+            metrics_add(&w->metrics.syscalls, 1);
+        }
+    }
+    if (c->recv_armed || c->send_inflight)
+        return;
 
-    printf("TEST] JOIN %u\n", peer_id);
+    int s = c->fd;
+    conn_release(&w->conns, s);
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL) {
+        close(s);
+        metrics_add(&w->metrics.syscalls, 1);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = s;
+    sqe->user_data = URING_DATA(UOP_CLOSE, 0, s);
+}
+
+// Dispatch request based on command, timing how long it takes to handle
+void dispatch_request(struct worker *w, struct conn *c, unsigned char *frame, size_t len) {
+    unsigned char cmd = frame[0];
+    uint64_t start = metrics_now();
+
+    // a replica's registry only follows its primary until it takes over
+    if ((cmd == CMD_JOIN || cmd == CMD_PUBLISH || cmd == CMD_PUBLISH_ADD || cmd == CMD_PUBLISH_REMOVE) &&
+        __atomic_load_n(&w->registry->read_only, __ATOMIC_ACQUIRE)) {
+        log_printf(LOG_DEBUG, "[DEBUG] Replica ignoring request 0x%02X on socket %d\n", cmd, c->fd);
+        return;
+    }
+
+    switch (cmd) {
+    case CMD_JOIN: {
+        uint32_t peer_id;
+        memcpy(&peer_id, frame + 1, sizeof(uint32_t));
+        handle_join(c->fd, ntohl(peer_id), w->registry, &c->addr);
+        break;
+    }
+
+    case CMD_PUBLISH:
+        handle_publish(c->fd, (char *)frame, len, w->registry);
+        break;
+
+    case CMD_PUBLISH_ADD:
+    case CMD_PUBLISH_REMOVE:
+        handle_publish_delta(c->fd, frame, len, w->registry);
+        break;
+
+    case CMD_VERSION:
+        handle_version(c, w->registry);
+        break;
+
+    case CMD_SEARCH:
+        handle_search(c, (char *)frame, w->registry);
+        break;
+
+    case CMD_MSEARCH:
+        handle_msearch(c, frame, len, w->registry);
+        break;
+
+    case CMD_SEARCHK:
+        handle_searchk(c, frame, w->registry);
+        break;
+
+    case CMD_FIND:
+        handle_find(c, frame, w->registry);
+        break;
+
+    case CMD_STATS:
+        handle_stats(c);
+        break;
+
+    case CMD_REPLICATE:
+        handle_replicate(w, c);
+        break;
+
+    case CMD_CLUSTER:
+        handle_cluster(c, w->registry);
+        break;
+
+    case CMD_PING:
+        handle_ping(c);
+        break;
+    }
+    histogram_record(&w->metrics.latency[cmd], metrics_now() - start);
+}
+
+// Handles a JOIN request from a peer
+void handle_join(int sockfd, uint32_t peer_id, struct registry *reg, struct sockaddr_storage *peer_addr) {
+    struct sockaddr_storage address;
+    memcpy(&address, peer_addr, sizeof(struct sockaddr_storage));
+    socklen_t addrlen = sizeof(address);
+    getpeername(sockfd, (struct sockaddr*)&address, &addrlen);
+
+    pthread_mutex_lock(&reg->write_lock);
+    struct peer_entry *before = find_peer_by_socket(sockfd, reg);
+    uint32_t old_id = before != NULL ? before->id : peer_id;
+    struct peer_entry *peer = add_peer(reg, sockfd, peer_id, &address);
+    if (peer != NULL) {
+        // the log keys lists by peer id, so a list moving to a new id is
+        // logged as the old id leaving and the new one publishing it
+        if (old_id != peer_id)
+            wal_append(reg->wal, WAL_LEAVE, old_id, NULL, 0);
+        wal_append_join(reg->wal, peer);
+        if (old_id != peer_id && peer->files.count > 0)
+            wal_append_files(reg->wal, reg, peer);
+    }
+    pthread_mutex_unlock(&reg->write_lock);
+    epoch_collect();
+    if (peer == NULL) return;
+
+    log_printf(LOG_INFO, "TEST] JOIN %u\n", peer_id);
 }
 
 // Handles a PUBLISH request and stores filenames sent by the peer
-void handle_publish(int sockfd, char *buf, int msg_len, int peer_count, struct peer_entry *peers) {
-    int index = find_peer_by_socket(sockfd, peer_count, peers);
-    if (index == -1 || msg_len < 6) return;
+void handle_publish(int sockfd, char *buf, int msg_len, struct registry *reg) {
+    if (msg_len < 5) return;
+
+    pthread_mutex_lock(&reg->write_lock);
+    struct peer_entry *peer = find_peer_by_socket(sockfd, reg);
+    if (peer == NULL) {
+        pthread_mutex_unlock(&reg->write_lock);
+        return;
+    }
+
+    // A PUBLISH replaces the peer's whole list, so drop the old one from the catalog
+    unpublish_all(reg, peer);
 
     // Skip 1 byte command + 4 bytes of peer ID
     int offset = 5;
+    int kept = 5;       // the names this shard owns are packed down to here
     int count = 0;
 
-    while (offset < msg_len && count < MAX_FILES) {
+    while (offset < msg_len) {
         int len = strnlen(buf + offset, MAX_FILENAME_LEN);
         if (len <= 0 || len >= MAX_FILENAME_LEN || offset + len + 1 > msg_len)
             break;
 
-        strncpy(peers[index].files[count], buf + offset, MAX_FILENAME_LEN);
-        count++;
+        if (owns_name(reg, buf + offset)) {
+            memmove(buf + kept, buf + offset, len + 1);
+            if (publish_file(reg, peer, buf + kept) == -1)
+                break;
+            kept += len + 1;
+            count++;
+        }
         offset += len + 1;
     }
+    peer->catalog_version++;
+    wal_append(reg->wal, WAL_PUBLISH, peer->id, buf + 5, kept - 5);
+    pthread_mutex_unlock(&reg->write_lock);
+    epoch_collect();
 
-    peers[index].file_count = count;
+    // One record so lines from other workers don't interleave
+    log_begin(LOG_INFO);
+    log_append("TEST] PUBLISH %d", count);
+    for (int i = 0, name = 5; i < count; i++) {
+        log_append(" %s", buf + name);
+        name += strlen(buf + name) + 1;
+    }
+    log_append("\n");
+    log_end();
+}
 
-    printf("TEST] PUBLISH %d", count);
-    for (int i = 0; i < count; i++) {
-        printf(" %s", peers[index].files[i]);
+// Handles PUBLISH_ADD / PUBLISH_REMOVE: only the named files change, the
+// rest of the peer's list and their catalog entries are left alone
+void handle_publish_delta(int sockfd, unsigned char *buf, size_t msg_len, struct registry *reg) {
+    int add = buf[0] == CMD_PUBLISH_ADD;
+    int changed = 0;
+    size_t kept = 5;        // the names applied are packed down to here
+
+    pthread_mutex_lock(&reg->write_lock);
+    struct peer_entry *peer = find_peer_by_socket(sockfd, reg);
+    if (peer == NULL) {
+        pthread_mutex_unlock(&reg->write_lock);
+        return;
     }
-    printf("\n");
+
+    for (size_t offset = 5; offset < msg_len; ) {
+        size_t len = strlen((const char *)buf + offset) + 1;
+        if (owns_name(reg, (const char *)buf + offset)) {
+            memmove(buf + kept, buf + offset, len);
+            const char *name = (const char *)buf + kept;
+            int rc = add ? publish_file(reg, peer, name) : unpublish_file(reg, peer, name);
+            if (rc == -1)
+                break;
+            changed += rc;
+            kept += len;
+        }
+        offset += len;
+    }
+    peer->catalog_version++;
+    wal_append(reg->wal, add ? WAL_PUBLISH_ADD : WAL_PUBLISH_REMOVE, peer->id, buf + 5, kept - 5);
+    uint32_t version = peer->catalog_version;
+    pthread_mutex_unlock(&reg->write_lock);
+    epoch_collect();
+
+    log_printf(LOG_INFO, "TEST] %s %d %u\n", add ? "PUBLISH_ADD" : "PUBLISH_REMOVE", changed, version);
+}
+
+// Handles a VERSION request so a peer can tell if its catalog is current
+void handle_version(struct conn *c, struct registry *reg) {
+    uint32_t version = 0, count = 0;
+    uint64_t fingerprint = 0;
+
+    // peer entries aren't epoch-protected, so this takes the write lock
+    pthread_mutex_lock(&reg->write_lock);
+    struct peer_entry *peer = find_peer_by_socket(c->fd, reg);
+    if (peer != NULL) {
+        version = peer->catalog_version;
+        count = peer->files.count;
+        fingerprint = peer->fingerprint;
+    }
+    pthread_mutex_unlock(&reg->write_lock);
+
+    unsigned char response[VERSION_RESPONSE_LEN];
+    uint32_t net_version = htonl(version);
+    uint32_t net_count = htonl(count);
+    uint32_t net_hi = htonl((uint32_t)(fingerprint >> 32));
+    uint32_t net_lo = htonl((uint32_t)fingerprint);
+    memcpy(response, &net_version, 4);
+    memcpy(response + 4, &net_count, 4);
+    memcpy(response + 8, &net_hi, 4);
+    memcpy(response + 12, &net_lo, 4);
+    conn_queue(c, response, sizeof response);
 }
 
 
 // Handles a SEARCH request from a peer looking for a file
-void handle_search(int sockfd, char *buf, int peer_count, struct peer_entry *peers) {
+void handle_search(struct conn *c, char *buf, struct registry *reg) {
     char *filename = buf + 1;
-    int index = find_peer_with_file(filename, peer_count, peers);
 
     char response[14];
     memcpy(response, "SEARCHOK", 8);
@@ -238,13 +1397,18 @@ void handle_search(int sockfd, char *buf, int peer_count, struct peer_entry *pee
     uint32_t ip = 0;
     uint16_t port = 0;
 
-    if (index != -1) {
-        // could you indicate where these values are set for the peers? in the handle_join function
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)&peers[index].address;
-        id = peers[index].id;
-        ip = addr_in->sin_addr.s_addr;
-        port = addr_in->sin_port;
+    struct holder holder;
+    epoch_enter();
+    int found = find_peer_with_file(filename, reg, &holder);
+    epoch_exit();
+    if (found) {
+        // the holder record is a copy of what handle_join stored for the peer
+        id = holder.peer_id;
+        ip = holder.ip;
+        port = holder.port;
+    }
 
+    if (found) {
         uint32_t net_ip = htonl(ip);
         uint16_t net_port = htons(port);
 
@@ -254,34 +1418,181 @@ void handle_search(int sockfd, char *buf, int peer_count, struct peer_entry *pee
         memset(response + 8, 0, 6);
     }
 
-    send(sockfd, response, 14, 0);
+    conn_queue(c, response, 14);
 
     struct in_addr addr;
     addr.s_addr = ip;
     char ip_str[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &addr, ip_str, INET_ADDRSTRLEN);
 
-    printf("TEST] SEARCH %s %u %s:%u\n",
+    log_printf(LOG_INFO, "TEST] SEARCH %s %u %s:%u\n",
         filename,
         id,
-        index != -1 ? ip_str : "0.0.0.0",
-        index != -1 ? ntohs(port) : 0
+        found ? ip_str : "0.0.0.0",
+        found ? ntohs(port) : 0
     );
 }
 
-// ******************************************************************************
-// For creating the server's connection
-int find_max_fd(const fd_set *fs) {
-	int ret = 0;
-	for(int i = FD_SETSIZE-1; i>=0 && ret==0; --i){
-		if( FD_ISSET(i, fs) ){
-			ret = i;
-		}
-	}
-	return ret;
+// Handles a MSEARCH request: one response with a record for every filename
+void handle_msearch(struct conn *c, unsigned char *buf, size_t msg_len, struct registry *reg) {
+    uint32_t count;
+    memcpy(&count, buf + 1, sizeof count);
+    conn_queue(c, &count, sizeof count);   // echoed back in network order
+    count = ntohl(count);
+
+    size_t offset = 5;
+    uint32_t found = 0;
+    for (uint32_t done = 0; done < count; ) {
+        const char *names[MSEARCH_BATCH];
+        int n = 0;
+        while (n < MSEARCH_BATCH && done + n < count && offset < msg_len) {
+            names[n++] = (const char *)buf + offset;
+            offset += strlen((const char *)buf + offset) + 1;
+        }
+
+        struct holder holders[MSEARCH_BATCH];
+        unsigned char records[MSEARCH_BATCH * SEARCH_RECORD_LEN];
+        epoch_enter();
+        found += find_peers_with_files(names, n, reg, holders);
+        epoch_exit();
+        for (int i = 0; i < n; i++)
+            pack_search_record(records + i * SEARCH_RECORD_LEN, &holders[i]);
+
+        conn_queue(c, records, n * SEARCH_RECORD_LEN);
+        done += n;
+    }
+
+    log_printf(LOG_INFO, "TEST] MSEARCH %u %u\n", count, found);
+}
+
+// Handles a SEARCHK request: up to K holders of one file, rotated per call
+void handle_searchk(struct conn *c, unsigned char *buf, struct registry *reg) {
+    int max = buf[1];
+    const char *filename = (const char *)buf + 2;
+
+    struct holder holders[UCHAR_MAX];
+    unsigned char response[4 + UCHAR_MAX * SEARCH_RECORD_LEN];
+    epoch_enter();
+    int n = find_peers_for_file(filename, max, reg, holders);
+    epoch_exit();
+    for (int i = 0; i < n; i++)
+        pack_search_record(response + 4 + i * SEARCH_RECORD_LEN, &holders[i]);
+
+    uint32_t net_n = htonl(n);
+    memcpy(response, &net_n, 4);
+    conn_queue(c, response, 4 + n * SEARCH_RECORD_LEN);
+
+    log_printf(LOG_INFO, "TEST] SEARCHK %s %d %d\n", filename, max, n);
+}
+
+// Handles a FIND request: one page of published names matching a prefix or
+// substring
+void handle_find(struct conn *c, unsigned char *buf, struct registry *reg) {
+    int mode = buf[1];
+    uint16_t limit;
+    memcpy(&limit, buf + 2, sizeof limit);
+    limit = ntohs(limit);
+    if (limit > MAX_FIND_PAGE)
+        limit = MAX_FIND_PAGE;
+    const char *pattern = (const char *)buf + 4;
+    const char *after = pattern + strlen(pattern) + 1;
+
+    uint32_t ids[MAX_FIND_PAGE];
+    epoch_enter();
+    int n = mode == FIND_PREFIX
+        ? catalog_prefix_search(&reg->catalog, pattern, after, limit, ids)
+        : catalog_substring_search(&reg->catalog, pattern, after, limit, ids);
+
+    uint32_t net_n = htonl(n);
+    conn_queue(c, &net_n, sizeof net_n);
+    for (int i = 0; i < n; i++) {
+        const char *name = catalog_entry_by_id(&reg->catalog, ids[i])->name;
+        conn_queue(c, name, strlen(name) + 1);
+    }
+    epoch_exit();
+
+    log_printf(LOG_INFO, "TEST] FIND %s %s %d\n", mode == FIND_PREFIX ? "PREFIX" : "SUBSTRING", pattern, n);
+}
+
+// Handles a STATS request with a text dump of every worker's metrics. The
+// report is only for operators on the same host.
+void handle_stats(struct conn *c) {
+    int local = 0;
+    if (c->addr.ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)&c->addr;
+        local = (ntohl(in->sin_addr.s_addr) >> 24) == 127;
+    } else if (c->addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&c->addr;
+        local = IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr) ||
+            (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr) && in6->sin6_addr.s6_addr[12] == 127);
+    }
+
+    char *text = local ? metrics_dump() : NULL;
+    uint32_t net_len = htonl(text != NULL ? strlen(text) : 0);
+    conn_queue(c, &net_len, sizeof net_len);
+    if (text != NULL)
+        conn_queue(c, text, strlen(text));
+    free(text);
 }
 
-int bind_and_listen( const char *service ) {
+void handle_cluster(struct conn *c, struct registry *reg) {
+    const char *spec = reg->shards != NULL ? reg->shards->spec : "";
+    uint32_t net_len = htonl(strlen(spec));
+    conn_queue(c, &net_len, sizeof net_len);
+    conn_queue(c, spec, strlen(spec));
+}
+
+// Answers a PING so a quiet peer can show it is still there
+void handle_ping(struct conn *c) {
+    unsigned char pong = CMD_PING;
+    conn_queue(c, &pong, 1);
+}
+
+// Whether name belongs in this registry: always, unless it is one shard of
+// a cluster and another member owns the name
+int owns_name(const struct registry *reg, const char *name) {
+    return reg->shards == NULL || shard_owner(reg->shards, name) == reg->shard_self;
+}
+
+// Hands the connection to the log, which feeds it from then on as a replica
+// (see protocol.h). A joined peer, or one with responses still unsent, can't
+// become one.
+void handle_replicate(struct worker *w, struct conn *c) {
+    struct registry *reg = w->registry;
+    int flags = fcntl(c->fd, F_GETFL);
+    int rc = -1;
+    pthread_mutex_lock(&reg->write_lock);
+    if (flags != -1 && c->out_bytes == 0 && find_peer_by_socket(c->fd, reg) == NULL &&
+        fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK) == 0) {
+        rc = wal_add_replica(reg->wal, reg, c->fd);
+        if (rc == -1)
+            fcntl(c->fd, F_SETFL, flags);
+    }
+    pthread_mutex_unlock(&reg->write_lock);
+    if (rc == -1) {
+        log_printf(LOG_WARN, "[WARN] Refused replica on socket %d\n", c->fd);
+        return;
+    }
+    c->detached = 1;
+    log_printf(LOG_DEBUG, "[DEBUG] Socket %d is now a replica\n", c->fd);
+}
+
+// Writes a holder's peer ID, address and port in network byte order, or
+// zeros if there is no holder
+void pack_search_record(unsigned char *rec, const struct holder *h) {
+    if (h == NULL || h->socket_fd == HOLDER_NONE) {
+        memset(rec, 0, SEARCH_RECORD_LEN);
+        return;
+    }
+    uint32_t net_id = htonl(h->peer_id);
+    memcpy(rec, &net_id, 4);
+    memcpy(rec + 4, &h->ip, 4);
+    memcpy(rec + 8, &h->port, 2);
+}
+
+// ******************************************************************************
+// For creating the server's connection
+int bind_and_listen( const char *service, int reuseport ) {
 	struct addrinfo hints;
 	struct addrinfo *rp, *result;
 	int s;
@@ -305,6 +1616,16 @@ int bind_and_listen( const char *service ) {
 			continue;
 		}
 
+		// A warm restart has to rebind while the old connections linger in
+		// TIME-WAIT. Sharded workers each bind the same port; the kernel
+		// balances accepts.
+		int yes = 1;
+		if ( setsockopt( s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes ) == -1 ||
+		     ( reuseport && setsockopt( s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes ) == -1 ) ) {
+			close( s );
+			continue;
+		}
+
 		if ( !bind( s, rp->ai_addr, rp->ai_addrlen ) ) {
 			break;
 		}
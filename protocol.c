@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+
+// Length of the null-terminated string at buf, including the NULL, or
+// FRAME_PARTIAL / FRAME_ERROR. The string may be empty.
+static long string_length(const unsigned char *buf, size_t len) {
+    size_t limit = len < MAX_FILENAME_LEN ? len : MAX_FILENAME_LEN;
+    const unsigned char *nul = memchr(buf, '\0', limit);
+    if (nul != NULL)
+        return nul - buf + 1;
+    return len < MAX_FILENAME_LEN ? FRAME_PARTIAL : FRAME_ERROR;
+}
+
+// Like string_length(), but a filename can't be empty
+static long filename_length(const unsigned char *buf, size_t len) {
+    long n = string_length(buf, len);
+    return n == 1 ? FRAME_ERROR : n;
+}
+
+// Length of a 4 byte count followed by that many filenames, or
+// FRAME_PARTIAL / FRAME_ERROR. Resumes from and updates scan, if any, so a
+// list arriving in many pieces is scanned once.
+static long counted_names_length(const unsigned char *buf, size_t len, struct frame_scan *scan) {
+    if (len < 4)
+        return FRAME_PARTIAL;
+    uint32_t count;
+    memcpy(&count, buf, sizeof count);
+    count = ntohl(count);
+
+    size_t need = 4;
+    uint32_t i = 0;
+    if (scan != NULL && scan->offset > need) {
+        need = scan->offset;
+        i = scan->names;
+    }
+    for (; i < count; i++) {
+        if (need > MAX_FRAME_SIZE)
+            return FRAME_ERROR;
+        long name_len = filename_length(buf + need, len - need);
+        if (name_len == FRAME_PARTIAL && scan != NULL) {
+            scan->offset = need;
+            scan->names = i;
+        }
+        if (name_len <= 0)
+            return name_len;
+        need += name_len;
+    }
+    return need;
+}
+
+int frame_decode(const unsigned char *buf, size_t len, size_t *frame_len, struct frame_scan *scan) {
+    if (len == 0)
+        return FRAME_PARTIAL;
+
+    size_t need;
+    long name_len;
+    switch (buf[0]) {
+    case CMD_JOIN:
+        need = 5;
+        break;
+
+    case CMD_PUBLISH:
+    case CMD_PUBLISH_ADD:
+    case CMD_PUBLISH_REMOVE:
+    case CMD_MSEARCH:
+        name_len = counted_names_length(buf + 1, len - 1, scan);
+        if (name_len <= 0)
+            return name_len;
+        need = 1 + name_len;
+        break;
+
+    case CMD_FIND: {
+        if (len < 4)
+            return FRAME_PARTIAL;
+        if (buf[1] != FIND_PREFIX && buf[1] != FIND_SUBSTRING)
+            return FRAME_ERROR;
+        long pattern_len = string_length(buf + 4, len - 4);
+        if (pattern_len <= 0)
+            return pattern_len;
+        name_len = string_length(buf + 4 + pattern_len, len - 4 - pattern_len);
+        if (name_len <= 0)
+            return name_len;
+        need = 4 + pattern_len + name_len;
+        break;
+    }
+
+    case CMD_VERSION:
+    case CMD_STATS:
+    case CMD_REPLICATE:
+    case CMD_CLUSTER:
+    case CMD_PING:
+        need = 1;
+        break;
+
+    case CMD_SEARCH:
+        name_len = filename_length(buf + 1, len - 1);
+        if (name_len <= 0)
+            return name_len;
+        need = 1 + name_len;
+        break;
+
+    case CMD_SEARCHK:
+        if (len < 2)
+            return FRAME_PARTIAL;
+        name_len = filename_length(buf + 2, len - 2);
+        if (name_len <= 0)
+            return name_len;
+        need = 2 + name_len;
+        break;
+
+    default:
+        return FRAME_ERROR;
+    }
+
+    if (need > MAX_FRAME_SIZE)
+        return FRAME_ERROR;
+    if (len < need)
+        return FRAME_PARTIAL;
+    *frame_len = need;
+    return FRAME_OK;
+}
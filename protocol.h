@@ -0,0 +1,85 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Request opcodes, the first byte of every message
+#define CMD_JOIN    0x00    // 4 byte peer ID
+#define CMD_PUBLISH 0x01    // 4 byte count, count null-terminated filenames
+#define CMD_SEARCH  0x02    // one null-terminated filename
+#define CMD_MSEARCH 0x04    // 4 byte count, count null-terminated filenames
+#define CMD_SEARCHK 0x05    // 1 byte max holders K, one null-terminated filename
+#define CMD_PUBLISH_ADD    0x06 // 4 byte count, filenames to add to the peer's list
+#define CMD_PUBLISH_REMOVE 0x07 // 4 byte count, filenames to drop from the peer's list
+#define CMD_VERSION        0x08 // no payload
+#define CMD_FIND           0x09 // 1 byte mode, 2 byte page size, pattern, resume-after name
+#define CMD_STATS          0x0A // no payload
+#define CMD_REPLICATE      0x0B // no payload
+#define CMD_CLUSTER        0x0C // no payload
+#define CMD_PING           0x0D // no payload
+
+// 0x03 (FETCH), 0x0E (FETCH_RANGE) and 0x0F (FETCH_HASHES) are taken by
+// requests peers send each other (see sample-files/peer-to-peer.c); the
+// registry never sees them
+
+// FIND modes. A FIND lists published filenames starting with (or containing)
+// the null-terminated pattern, at most page size names per response, starting
+// after the null-terminated resume name (empty for the first page). The
+// response is a 4 byte count followed by that many null-terminated names.
+// Prefix matches come back sorted by name, substring matches in the order
+// the names were first published; either way the last name of a page is the
+// resume name for the next one, and a short page is the last.
+#define FIND_PREFIX    0
+#define FIND_SUBSTRING 1
+#define MAX_FIND_PAGE  1024
+
+// A MSEARCH response is a 4 byte count followed by one record per name:
+// 4 byte peer ID, 4 byte IPv4 address, 2 byte port, all in network byte
+// order and all zero when no peer has the file. A SEARCHK response is a 4 byte
+// count of holders (at most K) followed by that many records.
+#define SEARCH_RECORD_LEN 10
+
+// A VERSION response is the peer's 4 byte catalog version, 4 byte file count
+// and 8 byte catalog fingerprint (XOR of the 64-bit FNV-1a hash of every
+// filename), all in network byte order and all zero before JOIN
+#define VERSION_RESPONSE_LEN 16
+
+// A STATS response is a 4 byte length in network byte order followed by
+// that many bytes of text, one "name value..." line per metric. Only
+// loopback connections get the report; anyone else gets a length of 0.
+
+// A CLUSTER response is a 4 byte length in network byte order followed by
+// that many bytes of the cluster's member list, "host:port,host:port,...",
+// or a length of 0 if the registry isn't sharded. A client builds the same
+// consistent-hash ring from it (see shard.h) to send each name's PUBLISH
+// and SEARCH to the member that owns it; members drop names they don't own.
+
+// A PING is answered with the single byte CMD_PING. Registries started with
+// an idle timeout close connections that send nothing for that long, so a
+// peer with nothing else to say pings to stay registered.
+
+// REPLICATE turns the connection into a feed for a replica registry: from
+// then on the registry only sends, as write-ahead log records (see wal.h),
+// first its current contents and then every change as it is logged.
+
+#define MAX_FILENAME_LEN 100        // including the NULL
+#define MAX_FRAME_SIZE (1 << 20)    // largest request a peer may send
+
+#define FRAME_ERROR   -1    // malformed or unknown request
+#define FRAME_PARTIAL  0    // more bytes are needed
+#define FRAME_OK       1
+
+// How far frame_decode() got through a name list that hasn't all arrived,
+// so the next call for the same request picks up there instead of
+// rescanning it. Zero it whenever a new request starts.
+struct frame_scan {
+    size_t offset;      // bytes of the list already checked
+    uint32_t names;     // whole names in them
+};
+
+// Looks for one complete request at the start of buf. On FRAME_OK the
+// request's length is stored in *frame_len. scan may be NULL.
+int frame_decode(const unsigned char *buf, size_t len, size_t *frame_len, struct frame_scan *scan);
+
+#endif
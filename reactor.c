@@ -0,0 +1,162 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "reactor.h"
+
+#ifndef USE_SELECT
+#include <sys/epoll.h>
+#endif
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+#ifdef USE_SELECT
+// ******************************************************************************
+// select() backend, kept so it can be benchmarked against epoll
+
+static int find_max_fd(const fd_set *fs, int start) {
+    for (int i = start; i >= 0; --i) {
+        if (FD_ISSET(i, fs))
+            return i;
+    }
+    return -1;
+}
+
+int reactor_init(struct reactor *r) {
+    FD_ZERO(&r->read_set);
+    FD_ZERO(&r->write_set);
+    r->max_fd = -1;
+    return 0;
+}
+
+void reactor_close(struct reactor *r) {
+    reactor_init(r);
+}
+
+int reactor_add(struct reactor *r, int fd, int events) {
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        errno = EMFILE;
+        return -1;
+    }
+    return reactor_mod(r, fd, events);
+}
+
+int reactor_mod(struct reactor *r, int fd, int events) {
+    FD_CLR(fd, &r->read_set);
+    FD_CLR(fd, &r->write_set);
+    if (events & REACTOR_READ)
+        FD_SET(fd, &r->read_set);
+    if (events & REACTOR_WRITE)
+        FD_SET(fd, &r->write_set);
+    if (events && fd > r->max_fd)
+        r->max_fd = fd;
+    return 0;
+}
+
+int reactor_del(struct reactor *r, int fd) {
+    FD_CLR(fd, &r->read_set);
+    FD_CLR(fd, &r->write_set);
+    if (fd == r->max_fd) {
+        int max_read = find_max_fd(&r->read_set, fd);
+        int max_write = find_max_fd(&r->write_set, fd);
+        r->max_fd = max_read > max_write ? max_read : max_write;
+    }
+    return 0;
+}
+
+int reactor_wait(struct reactor *r, struct reactor_event *events, int max_events, int timeout_ms) {
+    // call sets are temporaries; select removes sockets that aren't ready
+    fd_set read_call = r->read_set;
+    fd_set write_call = r->write_set;
+    struct timeval tv, *tvp = NULL;
+    if (timeout_ms >= 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    int num_s = select(r->max_fd + 1, &read_call, &write_call, NULL, tvp);
+    if (num_s <= 0)
+        return num_s;
+
+    int n = 0;
+    for (int s = 0; s <= r->max_fd && n < max_events; ++s) {
+        int ev = 0;
+        if (FD_ISSET(s, &read_call))
+            ev |= REACTOR_READ;
+        if (FD_ISSET(s, &write_call))
+            ev |= REACTOR_WRITE;
+        if (ev) {
+            events[n].fd = s;
+            events[n].events = ev;
+            n++;
+        }
+    }
+    return n;
+}
+
+#else
+// ******************************************************************************
+// epoll backend, edge-triggered
+
+static uint32_t to_epoll(int events) {
+    uint32_t ev = EPOLLET | EPOLLRDHUP;
+    if (events & REACTOR_READ)
+        ev |= EPOLLIN;
+    if (events & REACTOR_WRITE)
+        ev |= EPOLLOUT;
+    return ev;
+}
+
+int reactor_init(struct reactor *r) {
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return r->epoll_fd < 0 ? -1 : 0;
+}
+
+void reactor_close(struct reactor *r) {
+    if (r->epoll_fd >= 0)
+        close(r->epoll_fd);
+    r->epoll_fd = -1;
+}
+
+int reactor_add(struct reactor *r, int fd, int events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = to_epoll(events);
+    ev.data.fd = fd;
+    return epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int reactor_mod(struct reactor *r, int fd, int events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = to_epoll(events);
+    ev.data.fd = fd;
+    return epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int reactor_del(struct reactor *r, int fd) {
+    return epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int reactor_wait(struct reactor *r, struct reactor_event *events, int max_events, int timeout_ms) {
+    struct epoll_event ready[max_events];
+    int n = epoll_wait(r->epoll_fd, ready, max_events, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        events[i].fd = ready[i].data.fd;
+        events[i].events = 0;
+        // hangups and errors surface as readable so recv() reports them
+        if (ready[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            events[i].events |= REACTOR_READ;
+        if (ready[i].events & EPOLLOUT)
+            events[i].events |= REACTOR_WRITE;
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <sys/select.h>
+
+/*
+ * Readiness notification for the registry's event loop.
+ *
+ * The default backend is epoll in edge-triggered mode: only fds that became
+ * ready are reported and there is no FD_SETSIZE ceiling. Building with
+ * -DUSE_SELECT (make BACKEND=select) swaps in the original select() loop so
+ * the two can be compared. Callers must treat every report as edge-triggered
+ * and drain the fd until EAGAIN; that is also correct for select().
+ * program4 -u bypasses the reactor for a completion loop on io_uring
+ * (uring.h).
+ */
+
+#define REACTOR_READ  0x1
+#define REACTOR_WRITE 0x2
+
+struct reactor_event {
+    int fd;
+    int events;     // REACTOR_READ / REACTOR_WRITE, errors are reported as READ
+};
+
+struct reactor {
+#ifdef USE_SELECT
+    fd_set read_set;
+    fd_set write_set;
+    int max_fd;
+#else
+    int epoll_fd;
+#endif
+};
+
+// Returns 0 on success, -1 with errno set on failure
+int reactor_init(struct reactor *r);
+void reactor_close(struct reactor *r);
+
+// Start, change or stop watching fd for the given REACTOR_* events
+int reactor_add(struct reactor *r, int fd, int events);
+int reactor_mod(struct reactor *r, int fd, int events);
+int reactor_del(struct reactor *r, int fd);
+
+// Waits up to timeout_ms (-1 blocks) and fills at most max_events ready fds.
+// Returns the number of events, or -1 with errno set.
+int reactor_wait(struct reactor *r, struct reactor_event *events, int max_events, int timeout_ms);
+
+// Puts fd into O_NONBLOCK mode
+int set_nonblocking(int fd);
+
+#endif
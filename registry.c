@@ -0,0 +1,360 @@
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "epoch.h"
+#include "registry.h"
+#include "wal.h"
+
+#define PEER_TABLE_MIN 64
+
+int registry_init(struct registry *reg) {
+    reg->peers = NULL;
+    reg->peer_capacity = 0;
+    reg->peer_count = 0;
+    reg->ghosts = NULL;
+    reg->ghost_capacity = 0;
+    reg->ghost_count = 0;
+    reg->ghost_serial = 0;
+    reg->wal = NULL;
+    reg->read_only = 0;
+    reg->shards = NULL;
+    reg->shard_self = 0;
+    if (catalog_init(&reg->catalog) == -1)
+        return -1;
+    return pthread_mutex_init(&reg->write_lock, NULL) == 0 ? 0 : -1;
+}
+
+void registry_destroy(struct registry *reg) {
+    for (int i = 0; i < reg->peer_capacity; i++) {
+        if (reg->peers[i] != NULL) {
+            file_set_free(&reg->peers[i]->files);
+            free(reg->peers[i]);
+        }
+    }
+    free(reg->peers);
+    for (int i = 0; i < reg->ghost_capacity; i++) {
+        if (reg->ghosts[i] != NULL) {
+            file_set_free(&reg->ghosts[i]->files);
+            free(reg->ghosts[i]);
+        }
+    }
+    free(reg->ghosts);
+    catalog_free(&reg->catalog);
+    pthread_mutex_destroy(&reg->write_lock);
+}
+
+// Finds a peer based on its socket FD
+struct peer_entry *find_peer_by_socket(int socket_fd, const struct registry *reg) {
+    if (socket_fd < 0 || socket_fd >= reg->peer_capacity)
+        return NULL;
+    return reg->peers[socket_fd];
+}
+
+// Finds a peer that has the requested file with one catalog lookup
+int find_peer_with_file(const char *filename, const struct registry *reg, struct holder *out) {
+    struct catalog_entry *e = catalog_find(&reg->catalog, filename);
+    const struct holder *h = e != NULL ? holder_list_first(catalog_holders(e)) : NULL;
+    if (h == NULL)
+        return 0;
+    *out = *h;
+    return 1;
+}
+
+int find_peers_with_files(const char *const *names, int n, const struct registry *reg, struct holder *out) {
+    struct catalog_entry *entries[n];
+    catalog_find_batch(&reg->catalog, names, n, entries);
+    int found = 0;
+    for (int i = 0; i < n; i++) {
+        const struct holder *h = entries[i] != NULL ? holder_list_first(catalog_holders(entries[i])) : NULL;
+        if (h != NULL) {
+            out[i] = *h;
+            found++;
+        } else {
+            out[i].socket_fd = HOLDER_NONE;
+        }
+    }
+    return found;
+}
+
+int find_peers_for_file(const char *filename, int max, const struct registry *reg, struct holder *out) {
+    struct catalog_entry *e = catalog_find(&reg->catalog, filename);
+    const struct holder_list *hl = e != NULL ? catalog_holders(e) : NULL;
+    uint32_t count = holder_list_count(hl);
+    if (count == 0)
+        return 0;
+
+    // a per-thread rotor spreads load just as well as a shared one and keeps
+    // readers from writing to a cache line they all share
+    static __thread unsigned int rotor;
+    unsigned int start = rotor++ % count;
+    int found = 0;
+    for (uint32_t i = 0; i < count && found < max; i++) {
+        const struct holder *h = &hl->h[(start + i) % count];
+        if (h->socket_fd != HOLDER_NONE)
+            out[found++] = *h;
+    }
+    return found;
+}
+
+// The holder record SEARCH answers with for this peer
+static struct holder peer_holder(const struct peer_entry *peer) {
+    const struct sockaddr_in *addr_in = (const struct sockaddr_in *)&peer->address;
+    struct holder h;
+    h.socket_fd = peer->socket_fd;
+    h.peer_id = peer->id;
+    h.ip = addr_in->sin_addr.s_addr;
+    h.port = addr_in->sin_port;
+    return h;
+}
+
+// Makes sure peers[socket_fd] exists, doubling the table as needed
+static int reserve_peer_slot(struct registry *reg, int socket_fd) {
+    if (socket_fd < reg->peer_capacity)
+        return 0;
+
+    int capacity = reg->peer_capacity ? reg->peer_capacity : PEER_TABLE_MIN;
+    while (capacity <= socket_fd)
+        capacity *= 2;
+
+    struct peer_entry **peers = realloc(reg->peers, capacity * sizeof *peers);
+    if (peers == NULL)
+        return -1;
+    memset(peers + reg->peer_capacity, 0, (capacity - reg->peer_capacity) * sizeof *peers);
+    reg->peers = peers;
+    reg->peer_capacity = capacity;
+    return 0;
+}
+
+// Home slot of peer_id in the ghost table (Fibonacci hashing)
+static int ghost_slot(const struct registry *reg, uint32_t peer_id) {
+    return (uint32_t)(peer_id * 2654435769u) & (reg->ghost_capacity - 1);
+}
+
+// Slot holding the ghost for peer_id, or -1
+static int ghost_index(const struct registry *reg, uint32_t peer_id) {
+    if (reg->ghost_count == 0)
+        return -1;
+    for (int i = ghost_slot(reg, peer_id); reg->ghosts[i] != NULL; i = (i + 1) & (reg->ghost_capacity - 1)) {
+        if (reg->ghosts[i]->id == peer_id)
+            return i;
+    }
+    return -1;
+}
+
+// Empties slot i, shifting later entries of the probe run back so lookups
+// never need tombstones
+static void ghost_delete(struct registry *reg, int i) {
+    int mask = reg->ghost_capacity - 1;
+    reg->ghosts[i] = NULL;
+    reg->ghost_count--;
+    for (int j = (i + 1) & mask; reg->ghosts[j] != NULL; j = (j + 1) & mask) {
+        int home = ghost_slot(reg, reg->ghosts[j]->id);
+        // move j back to i unless its home lies cyclically in (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            reg->ghosts[i] = reg->ghosts[j];
+            reg->ghosts[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+// Doubles the ghost table once it is half full
+static int ghost_reserve(struct registry *reg) {
+    if ((reg->ghost_count + 1) * 2 <= reg->ghost_capacity)
+        return 0;
+    int old_capacity = reg->ghost_capacity;
+    struct peer_entry **old = reg->ghosts;
+    int capacity = old_capacity ? old_capacity * 2 : PEER_TABLE_MIN;
+    struct peer_entry **ghosts = calloc(capacity, sizeof *ghosts);
+    if (ghosts == NULL)
+        return -1;
+    reg->ghosts = ghosts;
+    reg->ghost_capacity = capacity;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i] == NULL)
+            continue;
+        int j = ghost_slot(reg, old[i]->id);
+        while (ghosts[j] != NULL)
+            j = (j + 1) & (capacity - 1);
+        ghosts[j] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// Hands a ghost's files to the peer that just joined with its id. The
+// catalog keeps each holder record where it was, so SEARCH answers don't
+// reorder, and the peer's VERSION shows the list it published before the
+// restart.
+static void adopt_ghost(struct registry *reg, struct peer_entry *peer) {
+    int i = ghost_index(reg, peer->id);
+    if (i == -1)
+        return;
+    struct peer_entry *ghost = reg->ghosts[i];
+    struct holder h = peer_holder(peer);
+    for (int j = 0; j < ghost->files.capacity; j++) {
+        uint32_t id = file_set_at(&ghost->files, j);
+        if (id != CATALOG_NONE)
+            catalog_update_holder(catalog_entry_by_id(&reg->catalog, id), ghost->socket_fd, &h);
+    }
+    file_set_free(&peer->files);
+    peer->files = ghost->files;
+    peer->catalog_version = ghost->catalog_version;
+    peer->fingerprint = ghost->fingerprint;
+    free(ghost);
+    ghost_delete(reg, i);
+}
+
+struct peer_entry *add_peer(struct registry *reg, int socket_fd, uint32_t peer_id, const struct sockaddr_storage *addr) {
+    if (socket_fd < 0 || reserve_peer_slot(reg, socket_fd) == -1)
+        return NULL;
+
+    struct peer_entry *peer = reg->peers[socket_fd];
+    if (peer == NULL) {
+        peer = calloc(1, sizeof *peer);
+        if (peer == NULL)
+            return NULL;
+        peer->socket_fd = socket_fd;
+        file_set_init(&peer->files);
+        reg->peers[socket_fd] = peer;
+        reg->peer_count++;
+    }
+    struct holder before = peer_holder(peer);
+    peer->id = peer_id;
+    memcpy(&peer->address, addr, sizeof(struct sockaddr_storage));
+
+    // a re-JOIN may change what SEARCH should answer for everything the
+    // peer already published
+    struct holder after = peer_holder(peer);
+    if (after.peer_id != before.peer_id || after.ip != before.ip || after.port != before.port) {
+        for (int i = 0; i < peer->files.capacity; i++) {
+            uint32_t id = file_set_at(&peer->files, i);
+            if (id != CATALOG_NONE)
+                catalog_update_holder(catalog_entry_by_id(&reg->catalog, id), peer->socket_fd, &after);
+        }
+    }
+
+    if (reg->ghost_count > 0 && peer->catalog_version == 0 && peer->files.count == 0)
+        adopt_ghost(reg, peer);
+    return peer;
+}
+
+// Removes a peer from the registry by socket FD (the caller closes the socket)
+void remove_peer(int socket_fd, struct registry *reg) {
+    struct peer_entry *peer = find_peer_by_socket(socket_fd, reg);
+    if (peer != NULL) {
+        unpublish_all(reg, peer);
+        file_set_free(&peer->files);
+        free(peer);
+        reg->peers[socket_fd] = NULL;
+        reg->peer_count--;
+    }
+}
+
+int publish_file(struct registry *reg, struct peer_entry *peer, const char *name) {
+    struct holder h = peer_holder(peer);
+    struct catalog_entry *e = catalog_add_holder(&reg->catalog, name, &h);
+    if (e == NULL)
+        return -1;
+
+    int rc = file_set_add(&peer->files, e->id);
+    if (rc == 1)
+        peer->fingerprint ^= e->hash;
+    else if (rc == -1)     // wasn't a holder before this call
+        catalog_remove_holder(e, peer->socket_fd);
+    return rc;
+}
+
+int unpublish_file(struct registry *reg, struct peer_entry *peer, const char *name) {
+    struct catalog_entry *e = catalog_find(&reg->catalog, name);
+    if (e == NULL || file_set_remove(&peer->files, e->id) == 0)
+        return 0;
+    peer->fingerprint ^= e->hash;
+    catalog_remove_holder(e, peer->socket_fd);
+    return 1;
+}
+
+void unpublish_all(struct registry *reg, struct peer_entry *peer) {
+    for (int i = 0; i < peer->files.capacity; i++) {
+        uint32_t id = file_set_at(&peer->files, i);
+        if (id != CATALOG_NONE)
+            catalog_remove_holder(catalog_entry_by_id(&reg->catalog, id), peer->socket_fd);
+    }
+    file_set_clear(&peer->files);
+    peer->fingerprint = 0;
+}
+
+struct peer_entry *find_ghost(const struct registry *reg, uint32_t peer_id) {
+    int i = ghost_index(reg, peer_id);
+    return i == -1 ? NULL : reg->ghosts[i];
+}
+
+struct peer_entry *add_ghost(struct registry *reg, uint32_t peer_id, const struct sockaddr_storage *addr) {
+    struct peer_entry *ghost = find_ghost(reg, peer_id);
+    if (ghost != NULL) {
+        // same rewrite as a re-JOIN on a live connection
+        struct holder before = peer_holder(ghost);
+        memcpy(&ghost->address, addr, sizeof(struct sockaddr_storage));
+        struct holder after = peer_holder(ghost);
+        if (after.ip != before.ip || after.port != before.port) {
+            for (int i = 0; i < ghost->files.capacity; i++) {
+                uint32_t id = file_set_at(&ghost->files, i);
+                if (id != CATALOG_NONE)
+                    catalog_update_holder(catalog_entry_by_id(&reg->catalog, id), ghost->socket_fd, &after);
+            }
+        }
+        return ghost;
+    }
+
+    if (ghost_reserve(reg) == -1 || (ghost = calloc(1, sizeof *ghost)) == NULL)
+        return NULL;
+    ghost->id = peer_id;
+    ghost->socket_fd = -2 - reg->ghost_serial++;   // any negative key but HOLDER_NONE
+    file_set_init(&ghost->files);
+    memcpy(&ghost->address, addr, sizeof(struct sockaddr_storage));
+    int i = ghost_slot(reg, peer_id);
+    while (reg->ghosts[i] != NULL)
+        i = (i + 1) & (reg->ghost_capacity - 1);
+    reg->ghosts[i] = ghost;
+    reg->ghost_count++;
+    return ghost;
+}
+
+void remove_ghost(struct registry *reg, uint32_t peer_id) {
+    int i = ghost_index(reg, peer_id);
+    if (i == -1)
+        return;
+    struct peer_entry *ghost = reg->ghosts[i];
+    unpublish_all(reg, ghost);
+    file_set_free(&ghost->files);
+    free(ghost);
+    ghost_delete(reg, i);
+}
+
+void for_each_peer(const struct registry *reg, void (*fn)(const struct peer_entry *peer, void *arg), void *arg) {
+    for (int i = 0; i < reg->peer_capacity; i++) {
+        if (reg->peers[i] != NULL)
+            fn(reg->peers[i], arg);
+    }
+    for (int i = 0; i < reg->ghost_capacity; i++) {
+        if (reg->ghosts[i] != NULL)
+            fn(reg->ghosts[i], arg);
+    }
+}
+
+void expire_ghosts(struct registry *reg) {
+    for (int i = 0; i < reg->ghost_capacity; i++) {
+        struct peer_entry *ghost = reg->ghosts[i];
+        if (ghost != NULL) {
+            // so replaying the log after another restart doesn't bring it back
+            wal_append(reg->wal, WAL_LEAVE, ghost->id, NULL, 0);
+            unpublish_all(reg, ghost);
+            file_set_free(&ghost->files);
+            free(ghost);
+        }
+    }
+    free(reg->ghosts);
+    reg->ghosts = NULL;
+    reg->ghost_capacity = 0;
+    reg->ghost_count = 0;
+}
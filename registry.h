@@ -0,0 +1,100 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "catalog.h"
+#include "fileset.h"
+
+struct wal;
+struct shard_ring;
+
+// Structure representing a peer entry. files holds the interned catalog ids
+// of what the peer published, so each filename is stored once in the catalog.
+// catalog_version counts the PUBLISH/ADD/REMOVE requests applied for the
+// peer and fingerprint is the XOR of its filenames' hashes, which lets a
+// peer check whether the registry already has its current list.
+struct peer_entry {
+    uint32_t id;
+    int socket_fd;
+    uint32_t catalog_version;
+    uint64_t fingerprint;
+    struct file_set files;
+    struct sockaddr_storage address;
+};
+
+// The peer/file index shared by every worker thread. JOIN/PUBLISH/VERSION
+// and disconnects serialize on write_lock. SEARCH-side lookups take no lock:
+// they run inside epoch_enter()/epoch_exit() and read only the catalog,
+// whose holder records carry everything a search answer needs. Peers are
+// indexed directly by socket fd; catalog maps each published filename to the
+// peers holding it.
+//
+// Ghosts are peers restored from a snapshot or the write-ahead log whose
+// connection went away with the old process, or that a replica learned of
+// from its primary, one per peer id. They keep
+// answering SEARCH until a peer with the same id JOINs and adopts their
+// file list, or until expire_ghosts() drops them.
+struct registry {
+    pthread_mutex_t write_lock;
+    struct peer_entry **peers;
+    int peer_capacity;
+    int peer_count;
+    struct catalog catalog;
+
+    struct peer_entry **ghosts;     // open addressing by peer id
+    int ghost_capacity;
+    int ghost_count;
+    int ghost_serial;               // numbers ghosts' stand-in socket_fd keys
+
+    struct wal *wal;                // mutations are logged here unless NULL
+    int read_only;                  // a replica; only its primary's stream changes it
+    const struct shard_ring *shards;    // the cluster this registry is one shard of, or NULL
+    int shard_self;                 // this registry's member index in shards
+};
+
+int registry_init(struct registry *reg);
+void registry_destroy(struct registry *reg);
+
+// Lock-free lookups; the caller must be inside epoch_enter()/epoch_exit().
+// Holders are copied out, so the results stay usable after epoch_exit().
+// Returns 1 and fills *out with the oldest holder of filename, or 0
+int find_peer_with_file(const char *filename, const struct registry *reg, struct holder *out);
+// Batched find_peer_with_file(): out[i] is the holder for names[i], with
+// socket_fd HOLDER_NONE if there is none. Returns how many were found.
+int find_peers_with_files(const char *const *names, int n, const struct registry *reg, struct holder *out);
+// Fills out[] with up to max holders of filename and returns how many.
+// Successive calls on a thread start one holder further along the list so
+// fetch load spreads over every replica.
+int find_peers_for_file(const char *filename, int max, const struct registry *reg, struct holder *out);
+
+// The caller must hold reg->write_lock for all of the following
+struct peer_entry *find_peer_by_socket(int socket_fd, const struct registry *reg);
+// Adds the peer on socket_fd, or renames it if that socket already joined.
+// A new peer whose id matches a ghost adopts the ghost's files, catalog
+// version and fingerprint. Returns NULL if out of memory.
+struct peer_entry *add_peer(struct registry *reg, int socket_fd, uint32_t peer_id, const struct sockaddr_storage *addr);
+void remove_peer(int socket_fd, struct registry *reg);
+// Adds name to the peer's file list and the catalog. Returns 1 if added, 0
+// if the peer already had it, -1 if out of memory.
+int publish_file(struct registry *reg, struct peer_entry *peer, const char *name);
+// Drops name from the peer's file list. Returns 1 if removed, 0 if the peer
+// didn't have it.
+int unpublish_file(struct registry *reg, struct peer_entry *peer, const char *name);
+// Clears the peer's file list and drops it from the catalog
+void unpublish_all(struct registry *reg, struct peer_entry *peer);
+
+// Returns the ghost for peer_id, or NULL
+struct peer_entry *find_ghost(const struct registry *reg, uint32_t peer_id);
+// Returns the ghost for peer_id, creating it if needed and updating its
+// address. Returns NULL if out of memory.
+struct peer_entry *add_ghost(struct registry *reg, uint32_t peer_id, const struct sockaddr_storage *addr);
+// Drops the ghost for peer_id and its files, if there is one
+void remove_ghost(struct registry *reg, uint32_t peer_id);
+// Calls fn for every live peer and every ghost not yet adopted
+void for_each_peer(const struct registry *reg, void (*fn)(const struct peer_entry *peer, void *arg), void *arg);
+// Drops every ghost nobody adopted, logging each as having left
+void expire_ghosts(struct registry *reg);
+
+#endif
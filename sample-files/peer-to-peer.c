@@ -3,6 +3,7 @@
  * ECEE 446 Section 1
  * Spring 2025
  */
+#define _GNU_SOURCE // for fallocate
 #include <stdio.h> // for file io
 #include <stdlib.h>
 #include <sys/types.h>
@@ -11,11 +12,59 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <dirent.h> // for reading file names in a direcory for the publish function
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fetch_server.h"
 
 #define MAX_SIZE 1200 // needs to be this large to store the file names from publish
 #define MAX_FILE_SIZE 100 // sets the max file size based on given specifications
+#define RECV_WINDOW_MIN (1 << 20) // first mapping of a file being downloaded
+#define RECV_WINDOW_MAX (64 << 20) // windows double up to this size
+#define SEARCHK 5
+#define MAX_HOLDERS 8 // peers a download is spread over
+
+// A peer holding a file, from a SEARCHK response
+struct holder {
+	uint32_t id;
+	char ip[INET_ADDRSTRLEN];
+	char port[6];
+};
+
+// Shared state of one chunked download
+struct download {
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+	const char *filename;
+	char *map; // the whole destination file
+	uint64_t size;
+	uint32_t chunk_size;
+	const uint64_t *hashes; // chunk_hash() of every chunk, or NULL
+	int chunk_count;
+	int done; // chunks received
+	int running; // workers that haven't given up yet
+	signed char *state; // per chunk: -1 once received, else workers fetching it
+};
+
+// One holder's connection in a chunked download
+struct range_worker {
+	pthread_t thread;
+	struct download *d;
+	struct holder *h;
+	int sock; // -1 until connected
+	int chunks; // chunks received from this holder
+};
+
+// Filenames sent by the last publish, sorted
+char **published = NULL;
+int published_count = -1; // -1 until the first PUBLISH
 
 /*
  * Lookup a host IP address and connect to it using service. Arguments match the first two
@@ -45,7 +94,22 @@ void join(const int *s, char *buf, const uint32_t *peerID);
  * no unused bytes between filenames
  * a publish cannot be larger than 1200 bytes (12 files)
 */
-void publish(const int *s, char *buf);
+void publish(const int *s);
+/**
+ * Helpers for incremental publishing
+ * the names sent by the last publish are remembered (sorted), and later
+ * publishes only send PUBLISH_ADD (6) / PUBLISH_REMOVE (7) deltas
+ * each delta has the same layout as a PUBLISH: 1 byte action, 4 bytes count, filenames
+ * before sending deltas a VERSION (8) request checks that the registry still
+ * has the list we last sent: it answers with 4 bytes version, 4 bytes file count
+ * and an 8 byte fingerprint (XOR of the FNV-1a hash of every filename)
+*/
+int list_shared_files(char ***names);
+int compare_names(const void *a, const void *b);
+void free_file_list(char **names, int count);
+void send_file_list(const int *s, char action, char **names, int count);
+uint64_t name_hash(const char *name);
+bool registry_in_sync(const int *s, char **names, int count);
 /**
  * look for peers with a desired filename
  * a request with the name of the file is sent from the peer
@@ -60,16 +124,67 @@ void publish(const int *s, char *buf);
 */
 void search(const int *s, char *buf);
 /**
- * Fetch a file from another peer and save it locally
+ * Fetch a file from other peers and save it locally
  * 1. read file name from terminal
- * 2. send a search request to the registry for the file
- * 3. receive peer information from the registry
- * 4. send a FETCH to the identified peer
- * 5. Recieve and save the file from the peer and save it 
- * to a file with the same name as the user requested in the local
+ * 2. send a SEARCHK request to the registry for up to MAX_HOLDERS holders
+ * 3. ask the first holder that answers for the size with a FETCH_RANGE,
+ * and for the hash of every chunk with a FETCH_HASHES
+ * 4. download the file in chunks from all of the holders at once, keeping
+ * the chunks of an earlier, interrupted download that are already right
+ * 5. if no holder knows FETCH_RANGE, send a plain FETCH to the first one
+ * the file is saved with the same name as the user requested in the local
  * directory of the peer application.
  */
 void fetch(const int *s, char *buf);
+/**
+ * FETCH_RANGE (14) asks a peer for part of a file: 1 byte action, 8 byte
+ * offset, 8 byte length (network byte order) and the null-terminated
+ * filename. the answer is a 1 byte response code, the 8 byte file size and
+ * then the bytes of the range that exist. a connection may carry any number
+ * of FETCH_RANGE requests one after another
+ * each holder gets its own connection and thread. the threads take
+ * FETCH_CHUNK sized chunks from a shared list; once none are left, an idle
+ * thread also fetches the chunk the fewest others are working on, so a
+ * slow or failed holder doesn't hold up the end of the download
+ * FETCH_HASHES (15) asks for a file's chunk hashes: 1 byte action and the
+ * null-terminated filename. the answer is a 1 byte response code, the
+ * 8 byte file size, 4 byte chunk size, 4 byte chunk count and an 8 byte
+ * chunk_hash() per chunk. with the hashes a download checks every chunk it
+ * receives, and resumes: only the chunks of the file already there whose
+ * hash doesn't match are fetched. without them a download can only resume
+ * by size, so one that fails is cut back to the chunks it got in order, and
+ * the next keeps the whole chunks of a file shorter than the one it fetches
+*/
+int find_holders(const int *s, char *buf, const char *filename, struct holder *holders, int max);
+int open_range(const char *filename, struct holder *h, uint64_t *size);
+int request_range(int sock, const char *filename, uint64_t offset, uint64_t length, uint64_t *size);
+int request_hashes(int sock, const char *filename, uint64_t size, uint64_t **hashes, uint32_t *chunk_size);
+off_t fetch_ranges(const char *filename, struct holder *holders, int count, int first, int first_sock,
+	uint64_t size, const uint64_t *hashes, uint32_t chunk_size);
+void *range_worker_run(void *arg);
+int take_chunk(struct download *d);
+void finish_chunk(struct download *d, int chunk, bool ok);
+off_t fetch_whole(const char *filename, struct holder *h);
+int recv_all(int sock, void *buf, size_t len);
+int send_all(int sock, const void *buf, size_t len);
+int reserve_space(int fd, off_t offset, off_t len);
+/**
+ * Receive the data of a FETCH response into filename
+ * the file is extended a window at a time and mapped, and recv() writes
+ * straight into the mapping, so the data is never copied through a
+ * separate buffer. windows double from RECV_WINDOW_MIN to RECV_WINDOW_MAX
+ * and the file is cut back to the bytes received at the end
+ * returns the number of bytes received or -1 on error
+*/
+off_t receive_file(int peer_sock, const char *filename);
+/**
+ * Serve FETCH, FETCH_RANGE and FETCH_HASHES requests from other peers
+ * the registry knows us by the address of our connection to it, so the
+ * listening socket is bound to that same local port (both sockets set
+ * SO_REUSEADDR). the requests are answered by an event loop in the
+ * background (see fetch_server.h)
+*/
+int open_fetch_listener(int s);
 
 int main(int argc, char *argv[]) {
 	char *host;
@@ -95,9 +210,21 @@ int main(int argc, char *argv[]) {
 		exit( 1 );
 	}
 
+	// a peer that hangs up mid-transfer shouldn't kill us
+	signal(SIGPIPE, SIG_IGN);
+	int listen_sock = open_fetch_listener(s);
+	if (listen_sock < 0 || fetch_server_start(listen_sock) == -1) {
+		fprintf(stderr, "Unable to serve FETCH requests\n");
+		exit(1);
+	}
+
 	while(1) {
 		printf("What would you like to do?: \n");
-		scanf("%s", userChoice);
+		if (scanf("%9s", userChoice) != 1) {
+			// end of input, same as EXIT
+			close( s );
+			return 0;
+		}
 		if(strcmp(userChoice, "JOIN") == 0) {
 			if (hasJoined) {
 				printf("Error: Already joined the registry.\n");
@@ -110,7 +237,7 @@ int main(int argc, char *argv[]) {
 		}
 		else if (strcmp(userChoice, "PUBLISH") == 0) {
 			if (hasJoined == true) {
-				publish(&s, buf);
+				publish(&s);
 				continue;
 			}
 			else {
@@ -159,38 +286,154 @@ void join(const int *s, char *buf, const uint32_t *peerID) {
 	send(*s, buf, 5, 0);
 }
 
-void publish(const int *s, char *buf) {
-    buf[0] = 1;
-	uint32_t count = 0;
-	int fileNameOffset = 5;
+void publish(const int *s) {
+	char **current;
+	int count = list_shared_files(&current);
+	if (count < 0) {
+		perror("Error reading SharedFiles");
+		return;
+	}
+
+	// The first PUBLISH, or one after the registry lost track of us, sends
+	// the whole list. Otherwise only the names that changed are sent.
+	if (published_count < 0 || !registry_in_sync(s, published, published_count)) {
+		send_file_list(s, 1, current, count);
+	}
+	else {
+		// both lists are sorted, so one merge pass finds the differences
+		char **added = malloc((count + 1) * sizeof *added);
+		char **removed = malloc((published_count + 1) * sizeof *removed);
+		int added_count = 0, removed_count = 0;
+		int i = 0, j = 0;
+		while (i < count || j < published_count) {
+			int cmp = i == count ? 1 : j == published_count ? -1 : strcmp(current[i], published[j]);
+			if (cmp < 0)
+				added[added_count++] = current[i++];
+			else if (cmp > 0)
+				removed[removed_count++] = published[j++];
+			else {
+				i++;
+				j++;
+			}
+		}
+
+		if (added_count > 0)
+			send_file_list(s, 6, added, added_count);
+		if (removed_count > 0)
+			send_file_list(s, 7, removed, removed_count);
+		if (added_count == 0 && removed_count == 0)
+			printf("Registry is already up to date\n");
+		free(added);
+		free(removed);
+	}
+
+	free_file_list(published, published_count);
+	published = current;
+	published_count = count;
+}
+
+int list_shared_files(char ***names) {
+	int count = 0, capacity = 16;
+	char **list = malloc(capacity * sizeof *list);
 
 	// Where I got this:
 	// https://chatgpt.com/share/67c8abd2-5d50-800a-853f-55de0a46d0c1
 	DIR *d;
 	struct dirent *dir;
 	d = opendir("SharedFiles");
+	if (d == NULL || list == NULL) {
+		free(list);
+		return -1;
+	}
 	while ((dir = readdir(d)) != NULL) {
 		if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0) {
         	continue;  // Skip these special directory entries
     	}
-		else {
-			count++;
-			// Where I go this
-			// https://chatgpt.com/share/67c8abd2-5d50-800a-853f-55de0a46d0c1
-			strcpy(&buf[fileNameOffset], dir->d_name);
-			// dir->d_name is the current filename
-			fileNameOffset += strlen(dir->d_name) + 1;
+		if (strlen(dir->d_name) >= MAX_FILE_SIZE) {
+			continue;  // too long for the registry
 		}
+		if (count == capacity) {
+			capacity *= 2;
+			list = realloc(list, capacity * sizeof *list);
+		}
+		list[count++] = strdup(dir->d_name);
 	}
 	closedir(d);
 
+	qsort(list, count, sizeof *list, compare_names);
+	*names = list;
+	return count;
+}
+
+int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+void free_file_list(char **names, int count) {
+	for (int i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+}
+
+void send_file_list(const int *s, char action, char **names, int count) {
+	int send_size = 5;
+	for (int i = 0; i < count; i++)
+		send_size += strlen(names[i]) + 1;
+
+	char *msg = malloc(send_size);
+	if (msg == NULL) {
+		perror("Error building PUBLISH request");
+		return;
+	}
+	msg[0] = action;
 	uint32_t net_count = htonl(count);
-	memcpy(buf + 1, &net_count, sizeof(uint32_t));
-    int send_size = fileNameOffset;
-    printf("Sending PUBLISH request: Action=%d, Count=%d, Total Size=%d\n", buf[0], count, send_size);
-    if (send(*s, buf, send_size, 0) == -1) {
+	memcpy(msg + 1, &net_count, sizeof(uint32_t));
+	int fileNameOffset = 5;
+	for (int i = 0; i < count; i++) {
+		strcpy(&msg[fileNameOffset], names[i]);
+		fileNameOffset += strlen(names[i]) + 1;
+	}
+
+    printf("Sending PUBLISH request: Action=%d, Count=%d, Total Size=%d\n", action, count, send_size);
+    if (send(*s, msg, send_size, 0) == -1) {
         perror("Error sending PUBLISH request");
     }
+	free(msg);
+}
+
+uint64_t name_hash(const char *name) {
+	// 64-bit FNV-1a, the same hash the registry uses
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+		h ^= *p;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+bool registry_in_sync(const int *s, char **names, int count) {
+	char request = 8;
+	unsigned char response[16];
+	if (send(*s, &request, 1, 0) != 1)
+		return false;
+	int received = 0;
+	while (received < 16) {
+		int n = recv(*s, response + received, 16 - received, 0);
+		if (n <= 0)
+			return false;
+		received += n;
+	}
+
+	uint32_t file_count, hi, lo;
+	memcpy(&file_count, response + 4, 4);
+	memcpy(&hi, response + 8, 4);
+	memcpy(&lo, response + 12, 4);
+	uint64_t fingerprint = ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+
+	uint64_t expected = 0;
+	for (int i = 0; i < count; i++)
+		expected ^= name_hash(names[i]);
+	return ntohl(file_count) == (uint32_t)count && fingerprint == expected;
 }
 
 void search(const int *s, char *buf) {
@@ -242,90 +485,472 @@ void search(const int *s, char *buf) {
 void fetch(const int *s, char *buf) {
 	char filename[MAX_FILE_SIZE];
 	printf("Enter a file name: ");
-	scanf("%s", filename);
-
-	// Send search request
-	buf[0] = 2;
-	strcpy(buf + 1, filename);
-	int msg_len = 1 + strlen(filename) + 1;
-	send(*s, buf, msg_len, 0);
-
-	// Receive registry response (10 bytes: 4 ID + 4 IP + 2 Port)
-	int received = recv(*s, buf, 10, 0);
-	if (received < 0) {
-		perror("recv");
+	scanf("%99s", filename);
+
+	struct holder holders[MAX_HOLDERS];
+	int count = find_holders(s, buf, filename, holders, MAX_HOLDERS);
+	if (count < 0) {
+		perror("Error receiving SEARCHK response");
 		return;
 	}
+	if (count == 0) {
+		printf("File not indexed by registry\n");
+		return;
+	}
+	for (int i = 0; i < count; i++)
+		printf("File found at Peer %u %s:%s\n", holders[i].id, holders[i].ip, holders[i].port);
+
+	// the first holder that answers a FETCH_RANGE tells us the size
+	uint64_t size = 0;
+	int first, first_sock = -1;
+	for (first = 0; first < count; first++)
+		if ((first_sock = open_range(filename, &holders[first], &size)) >= 0)
+			break;
 
-	uint32_t peer_id, peer_ip;
-	uint16_t peer_port;
-	memcpy(&peer_id, buf, 4);
-	memcpy(&peer_ip, buf + 4, 4);
-	memcpy(&peer_port, buf + 8, 2);
-	peer_id = ntohl(peer_id);
-	peer_port = ntohs(peer_port);
+	// a peer without FETCH_HASHES hangs up on it; download unchecked then
+	uint64_t *hashes = NULL;
+	uint32_t chunk_size = FETCH_CHUNK;
+	if (first_sock >= 0 && request_hashes(first_sock, filename, size, &hashes, &chunk_size) == -1) {
+		close(first_sock);
+		first_sock = open_range(filename, &holders[first], &size);
+	}
 
-	if (peer_id == 0 && peer_ip == 0 && peer_port == 0) {
-		printf("File not indexed by registry\n");
+	off_t bytes;
+	if (first_sock < 0)
+		bytes = fetch_whole(filename, &holders[0]);
+	else
+		bytes = fetch_ranges(filename, holders, count, first, first_sock, size, hashes, chunk_size);
+	free(hashes);
+	if (bytes < 0) {
+		printf("Unable to fetch file %s\n", filename);
 		return;
 	}
+	printf("File %s downloaded successfully (%lld bytes).\n", filename, (long long)bytes);
+}
+
+int find_holders(const int *s, char *buf, const char *filename, struct holder *holders, int max) {
+	buf[0] = SEARCHK;
+	buf[1] = max;
+	strcpy(buf + 2, filename);
+	if (send_all(*s, buf, 2 + strlen(filename) + 1) == -1)
+		return -1;
+
+	// 4 byte count, then 4 byte ID, 4 byte IPv4 address, 2 byte port per holder
+	uint32_t net_count;
+	if (recv_all(*s, &net_count, 4) == -1)
+		return -1;
+	int count = ntohl(net_count);
+	for (int i = 0; i < count; i++) {
+		unsigned char rec[10];
+		if (recv_all(*s, rec, sizeof rec) == -1)
+			return -1;
+		if (i >= max)
+			continue;
+		uint32_t id;
+		uint16_t port;
+		memcpy(&id, rec, 4);
+		memcpy(&port, rec + 8, 2);
+		holders[i].id = ntohl(id);
+		inet_ntop(AF_INET, rec + 4, holders[i].ip, sizeof holders[i].ip);
+		snprintf(holders[i].port, sizeof holders[i].port, "%u", ntohs(port));
+	}
+	return count < max ? count : max;
+}
+
+// Connects to h and asks for an empty range to learn the file's size.
+// Returns the connected socket, or -1 if h can't serve the file in ranges.
+int open_range(const char *filename, struct holder *h, uint64_t *size) {
+	int sock = lookup_and_connect(h->ip, h->port);
+	if (sock < 0)
+		return -1;
+	if (request_range(sock, filename, 0, 0, size) == -1) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+// Sends a FETCH_RANGE and reads the response header; the range's data
+// follows. Returns -1 if the request failed or the peer refused it.
+int request_range(int sock, const char *filename, uint64_t offset, uint64_t length, uint64_t *size) {
+	unsigned char req[17 + MAX_FILE_SIZE];
+	size_t name_len = strlen(filename) + 1;
+	req[0] = FETCH_RANGE;
+	put_u64(req + 1, offset);
+	put_u64(req + 9, length);
+	memcpy(req + 17, filename, name_len);
+	if (send_all(sock, req, 17 + name_len) == -1)
+		return -1;
+
+	unsigned char header[RANGE_HEADER_LEN];
+	if (recv_all(sock, header, sizeof header) == -1 || header[0] != 0)
+		return -1;
+	*size = get_u64(header + 1);
+	return 0;
+}
+
+// Asks for the file's chunk hashes. Returns -1, with the connection in an
+// unknown state, if the peer couldn't send them for a file of this size.
+int request_hashes(int sock, const char *filename, uint64_t size, uint64_t **hashes, uint32_t *chunk_size) {
+	unsigned char req[1 + MAX_FILE_SIZE];
+	req[0] = FETCH_HASHES;
+	strcpy((char *)req + 1, filename);
+	unsigned char header[HASHES_HEADER_LEN];
+	if (send_all(sock, req, 1 + strlen(filename) + 1) == -1 ||
+	    recv_all(sock, header, sizeof header) == -1 || header[0] != 0)
+		return -1;
+
+	uint32_t net_chunk_size, net_count;
+	memcpy(&net_chunk_size, header + 9, 4);
+	memcpy(&net_count, header + 13, 4);
+	uint32_t count = ntohl(net_count);
+	*chunk_size = ntohl(net_chunk_size);
+	if (get_u64(header + 1) != size || *chunk_size == 0 ||
+	    count != (size + *chunk_size - 1) / *chunk_size)
+		return -1;
+	unsigned char *raw = malloc((size_t)count * 8 + 1);
+	*hashes = malloc((size_t)count * sizeof **hashes + 1);
+	if (raw == NULL || *hashes == NULL || recv_all(sock, raw, (size_t)count * 8) == -1) {
+		free(raw);
+		free(*hashes);
+		*hashes = NULL;
+		return -1;
+	}
+	for (uint32_t i = 0; i < count; i++)
+		(*hashes)[i] = get_u64(raw + (size_t)i * 8);
+	free(raw);
+	return 0;
+}
 
-	// Convert IP to string
-	struct in_addr ip_addr;
-	ip_addr.s_addr = peer_ip;
-	char ip_str[INET_ADDRSTRLEN];
-	inet_ntop(AF_INET, &ip_addr, ip_str, INET_ADDRSTRLEN);
-	printf("Fetching file from Peer %u at %s:%u\n", peer_id, ip_str, peer_port);
+off_t fetch_ranges(const char *filename, struct holder *holders, int count, int first, int first_sock,
+	uint64_t size, const uint64_t *hashes, uint32_t chunk_size) {
+	int fd = open(filename, O_RDWR | O_CREAT, 0644);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror("Error opening file to write");
+		if (fd != -1)
+			close(fd);
+		close(first_sock);
+		return -1;
+	}
+	// with hashes every chunk already there can be checked; without them
+	// only a shorter file, the prefix a failed download leaves, is trusted
+	uint64_t kept = (uint64_t)st.st_size < size ? (uint64_t)st.st_size : hashes != NULL ? size : 0;
+	if ((uint64_t)st.st_size > kept && ftruncate(fd, kept) == -1) {
+		perror("Error truncating file");
+		close(fd);
+		close(first_sock);
+		return -1;
+	}
 
-	// Connect to peer
-	char port_str[10];
-	sprintf(port_str, "%u", peer_port);
-	int peer_sock = lookup_and_connect(ip_str, port_str);
+	struct download d;
+	pthread_mutex_init(&d.lock, NULL);
+	pthread_cond_init(&d.finished, NULL);
+	d.filename = filename;
+	d.map = NULL;
+	d.size = size;
+	d.chunk_size = chunk_size;
+	d.hashes = hashes;
+	d.chunk_count = (size + chunk_size - 1) / chunk_size;
+	d.done = 0;
+	d.running = 0;
+	d.state = calloc(d.chunk_count + 1, 1);
+	if (size > 0 && reserve_space(fd, 0, size) == -1) {
+		perror("Error allocating file space");
+		d.chunk_count = -1;
+	} else if (size > 0 && (d.map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror("Error mapping file");
+		d.map = NULL;
+		d.chunk_count = -1;
+	}
+	if (d.state == NULL || d.chunk_count < 0) {
+		close(first_sock);
+		close(fd);
+		free(d.state);
+		return -1;
+	}
+
+	for (int i = 0; i < d.chunk_count; i++) {
+		uint64_t offset = (uint64_t)i * chunk_size;
+		uint64_t length = size - offset < chunk_size ? size - offset : chunk_size;
+		if (offset + length > kept)
+			break;
+		if (hashes == NULL || chunk_hash((unsigned char *)d.map + offset, length) == hashes[i]) {
+			d.state[i] = -1;
+			d.done++;
+		}
+	}
+	if (d.done > 0)
+		printf("Resuming: %d of %d chunks are already here%s\n", d.done, d.chunk_count,
+			hashes == NULL ? " (not checked, the holder sends no hashes)" : "");
+
+	// holders before first already failed to answer
+	struct range_worker workers[MAX_HOLDERS];
+	int started = 0;
+	for (int i = first; i < count; i++) {
+		struct range_worker *w = &workers[started];
+		w->d = &d;
+		w->h = &holders[i];
+		w->sock = i == first ? first_sock : -1;
+		w->chunks = 0;
+		d.running++;
+		if (pthread_create(&w->thread, NULL, range_worker_run, w) != 0) {
+			d.running--;
+			if (w->sock != -1)
+				close(w->sock);
+			continue;
+		}
+		started++;
+	}
+
+	// A worker may still be receiving a chunk someone else finished first;
+	// shutting its socket down stops it without waiting for the slow holder
+	pthread_mutex_lock(&d.lock);
+	while (d.done < d.chunk_count && d.running > 0)
+		pthread_cond_wait(&d.finished, &d.lock);
+	for (int i = 0; i < started; i++)
+		if (workers[i].sock != -1)
+			shutdown(workers[i].sock, SHUT_RDWR);
+	pthread_mutex_unlock(&d.lock);
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].sock != -1)
+			close(workers[i].sock);
+		printf("Peer %u sent %d of %d chunks\n", workers[i].h->id, workers[i].chunks, d.chunk_count);
+	}
+
+	bool complete = d.done == d.chunk_count;
+	if (d.map != NULL)
+		munmap(d.map, size);
+	if (!complete && hashes == NULL) {
+		// keep only what the next attempt can trust by size alone
+		int prefix = 0;
+		while (prefix < d.chunk_count && d.state[prefix] == -1)
+			prefix++;
+		if (ftruncate(fd, (off_t)prefix * chunk_size) == -1)
+			perror("Error truncating file");
+	}
+	close(fd);
+	free(d.state);
+	pthread_mutex_destroy(&d.lock);
+	pthread_cond_destroy(&d.finished);
+	return complete ? (off_t)size : -1;
+}
+
+void *range_worker_run(void *arg) {
+	struct range_worker *w = arg;
+	struct download *d = w->d;
+	if (w->sock == -1) {
+		int sock = lookup_and_connect(w->h->ip, w->h->port);
+		pthread_mutex_lock(&d->lock);
+		w->sock = sock;
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	int chunk;
+	while (w->sock != -1 && (chunk = take_chunk(d)) != -1) {
+		uint64_t offset = (uint64_t)chunk * d->chunk_size;
+		uint64_t length = d->size - offset < d->chunk_size ? d->size - offset : d->chunk_size;
+		uint64_t size;
+		// a holder with a different version of the file is no use
+		bool ok = request_range(w->sock, d->filename, offset, length, &size) == 0 &&
+			size == d->size && recv_all(w->sock, d->map + offset, length) == 0;
+		if (ok && d->hashes != NULL && chunk_hash((unsigned char *)d->map + offset, length) != d->hashes[chunk]) {
+			printf("Chunk %d from Peer %u is corrupt\n", chunk, w->h->id);
+			ok = false;
+		}
+		finish_chunk(d, chunk, ok);
+		if (!ok)
+			break;
+		w->chunks++;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	d->running--;
+	pthread_cond_signal(&d->finished);
+	pthread_mutex_unlock(&d->lock);
+	return NULL;
+}
+
+// Picks the first chunk nobody has started, or else the unfinished chunk the
+// fewest workers are fetching. Two workers on one chunk write the same bytes
+// to the same place, and whichever is first completes it. -1 when every
+// chunk is in.
+int take_chunk(struct download *d) {
+	pthread_mutex_lock(&d->lock);
+	int pick = -1;
+	for (int i = 0; i < d->chunk_count; i++) {
+		if (d->state[i] == 0) {
+			pick = i;
+			break;
+		}
+		if (d->state[i] > 0 && (pick == -1 || d->state[i] < d->state[pick]))
+			pick = i;
+	}
+	if (pick != -1)
+		d->state[pick]++;
+	pthread_mutex_unlock(&d->lock);
+	return pick;
+}
+
+void finish_chunk(struct download *d, int chunk, bool ok) {
+	pthread_mutex_lock(&d->lock);
+	if (ok && d->state[chunk] != -1) {
+		d->state[chunk] = -1;
+		if (++d->done == d->chunk_count)
+			pthread_cond_signal(&d->finished);
+	} else if (!ok && d->state[chunk] > 0) {
+		d->state[chunk]--;
+	}
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Downloads the whole file with a plain FETCH, for peers without FETCH_RANGE
+off_t fetch_whole(const char *filename, struct holder *h) {
+	printf("Fetching file from Peer %u at %s:%s\n", h->id, h->ip, h->port);
+	int peer_sock = lookup_and_connect(h->ip, h->port);
 	if (peer_sock < 0) {
 		fprintf(stderr, "Failed to connect to peer\n");
-		return;
+		return -1;
 	}
 
-	// Send FETCH request
 	char fetch_req[MAX_FILE_SIZE + 1];
-	fetch_req[0] = 3;
+	fetch_req[0] = FETCH;
 	strcpy(fetch_req + 1, filename);
-	int fetch_len = 1 + strlen(filename) + 1;
-	send(peer_sock, fetch_req, fetch_len, 0);
-
-	// Receive FETCH response (1 byte response code)
 	char response_code;
-	int res = recv(peer_sock, &response_code, 1, 0);
-	if (res != 1) {
+	if (send_all(peer_sock, fetch_req, 1 + strlen(filename) + 1) == -1 ||
+	    recv_all(peer_sock, &response_code, 1) == -1) {
 		perror("Error receiving response code");
 		close(peer_sock);
-		return;
+		return -1;
 	}
-
-	// Open file for writing
 	if (response_code != 0) {
 		printf("Peer unable to send file.\n");
 		close(peer_sock);
-		return;
+		return -1;
+	}
+
+	off_t bytes = receive_file(peer_sock, filename);
+	close(peer_sock);
+	return bytes;
+}
+
+int recv_all(int sock, void *buf, size_t len) {
+	size_t received = 0;
+	while (received < len) {
+		ssize_t n = recv(sock, (char *)buf + received, len - received, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		received += n;
+	}
+	return 0;
+}
+
+int send_all(int sock, const void *buf, size_t len) {
+	size_t sent = 0;
+	while (sent < len) {
+		ssize_t n = send(sock, (const char *)buf + sent, len - sent, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		sent += n;
 	}
+	return 0;
+}
+
+// Extends the file to cover [offset, offset + len), with the disk space
+// allocated up front where the filesystem can, so writes through a mapping
+// don't fault on a full disk
+int reserve_space(int fd, off_t offset, off_t len) {
+	int rc = fallocate(fd, 0, offset, len);
+	if (rc == -1 && errno == EOPNOTSUPP)
+		rc = ftruncate(fd, offset + len);
+	return rc;
+}
 
-	FILE *fp = fopen(filename, "wb");
-	if (!fp) {
+off_t receive_file(int peer_sock, const char *filename) {
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
 		perror("Error opening file to write");
-		close(peer_sock);
-		return;
+		return -1;
 	}
 
-	// Receive file data
-	char file_buf[1024];
-	int bytes;
-	while ((bytes = recv(peer_sock, file_buf, sizeof(file_buf), 0)) > 0) {
-		fwrite(file_buf, 1, bytes, fp);
+	off_t received = 0;
+	off_t window_start = 0;
+	size_t window = 0;
+	char *map = NULL;
+	int failed = 0;
+	while (1) {
+		if (received == window_start + (off_t)window) {
+			// the mapped window is full; extend the file and map the next one
+			if (map != NULL)
+				munmap(map, window);
+			map = NULL;
+			window_start = received;
+			window = window == 0 ? RECV_WINDOW_MIN : window < RECV_WINDOW_MAX ? window * 2 : window;
+			if (reserve_space(fd, window_start, window) == -1) {
+				perror("Error allocating file space");
+				failed = 1;
+				break;
+			}
+			map = mmap(NULL, window, PROT_WRITE, MAP_SHARED, fd, window_start);
+			if (map == MAP_FAILED) {
+				perror("Error mapping file");
+				map = NULL;
+				failed = 1;
+				break;
+			}
+		}
+
+		ssize_t n = recv(peer_sock, map + (received - window_start), window_start + window - received, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			perror("Error receiving file data");
+			failed = 1;
+			break;
+		}
+		if (n == 0)
+			break;
+		received += n;
 	}
 
-	fclose(fp);
-	close(peer_sock);
-	printf("File %s downloaded successfully.\n", filename);
+	if (map != NULL)
+		munmap(map, window);
+	if (ftruncate(fd, received) == -1) {
+		perror("Error truncating file");
+		failed = 1;
+	}
+	close(fd);
+	return failed ? -1 : received;
+}
+
+int open_fetch_listener(int s) {
+	struct sockaddr_in local;
+	socklen_t len = sizeof local;
+	if (getsockname(s, (struct sockaddr *)&local, &len) == -1) {
+		perror("Error finding local port");
+		return -1;
+	}
+	int l = socket(AF_INET, SOCK_STREAM, 0);
+	if (l == -1) {
+		perror("Error creating FETCH socket");
+		return -1;
+	}
+	int on = 1;
+	setsockopt(l, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(l, (struct sockaddr *)&local, sizeof local) == -1 || listen(l, SOMAXCONN) == -1) {
+		perror("Error in listen");
+		close(l);
+		return -1;
+	}
+	printf("Listening for FETCH commands on port %u\n", ntohs(local.sin_port));
+	return l;
 }
 
 int lookup_and_connect( const char *host, const char *service ) {
@@ -351,6 +976,10 @@ int lookup_and_connect( const char *host, const char *service ) {
 			continue;
 		}
 
+		// lets the FETCH listener share this connection's local port
+		int on = 1;
+		setsockopt( s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on );
+
 		if ( connect( s, rp->ai_addr, rp->ai_addrlen ) != -1 ) {
 			break;
 		}
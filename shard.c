@@ -0,0 +1,107 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shard.h"
+
+// FNV-1a, then a finalizer: FNV alone clusters the points of names that
+// differ only in their last characters
+static uint64_t ring_hash(const char *s, int vnode) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= (uint64_t)vnode * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static int compare_points(const void *a, const void *b) {
+    const struct shard_point *x = a, *y = b;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return x->member - y->member;
+}
+
+int shard_split_address(const char *member, char *host, int host_size, const char **port) {
+    const char *colon = strrchr(member, ':');
+    if (colon == NULL || colon == member || colon[1] == '\0' || colon - member >= host_size)
+        return -1;
+    memcpy(host, member, colon - member);
+    host[colon - member] = '\0';
+    *port = colon + 1;
+    return 0;
+}
+
+int shard_ring_init(struct shard_ring *ring, const char *spec) {
+    memset(ring, 0, sizeof *ring);
+    ring->spec = strdup(spec);
+    char *list = ring->names = strdup(spec);
+    ring->members = calloc(SHARD_MAX_MEMBERS, sizeof *ring->members);
+    if (ring->spec == NULL || list == NULL || ring->members == NULL) {
+        shard_ring_free(ring);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    char *save, host[256];
+    const char *port;
+    for (char *m = strtok_r(list, ",", &save); m != NULL; m = strtok_r(NULL, ",", &save)) {
+        if (ring->member_count == SHARD_MAX_MEMBERS || shard_split_address(m, host, sizeof host, &port) == -1) {
+            free(list);
+            shard_ring_free(ring);
+            errno = EINVAL;
+            return -1;
+        }
+        ring->members[ring->member_count++] = m;
+    }
+    if (ring->member_count == 0) {
+        shard_ring_free(ring);
+        errno = EINVAL;
+        return -1;
+    }
+
+    ring->points = malloc((size_t)ring->member_count * SHARD_VNODES * sizeof *ring->points);
+    if (ring->points == NULL) {
+        shard_ring_free(ring);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (int m = 0; m < ring->member_count; m++) {
+        for (int v = 0; v < SHARD_VNODES; v++) {
+            ring->points[ring->point_count].hash = ring_hash(ring->members[m], v + 1);
+            ring->points[ring->point_count].member = m;
+            ring->point_count++;
+        }
+    }
+    qsort(ring->points, ring->point_count, sizeof *ring->points, compare_points);
+    return 0;
+}
+
+void shard_ring_free(struct shard_ring *ring) {
+    free(ring->names);
+    free(ring->members);
+    free(ring->points);
+    free(ring->spec);
+    memset(ring, 0, sizeof *ring);
+}
+
+int shard_owner(const struct shard_ring *ring, const char *filename) {
+    if (ring->member_count == 1)
+        return 0;
+    uint64_t h = ring_hash(filename, 0);
+    int lo = 0, hi = ring->point_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return ring->points[lo == ring->point_count ? 0 : lo].member;
+}
@@ -0,0 +1,47 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+
+/*
+ * Consistent-hash ring splitting the filename keyspace across a cluster of
+ * registries.
+ *
+ * A cluster is named by its member list, "host:port,host:port,...", the
+ * same on every member and every client. Each member gets SHARD_VNODES
+ * points on a 64-bit ring, hashed from its host:port, and a filename
+ * belongs to the member owning the first point at or after the name's hash.
+ * Adding or removing a member only moves the names between it and its
+ * neighbours on the ring.
+ */
+
+#define SHARD_VNODES 160    // ring points per member
+#define SHARD_MAX_MEMBERS 64
+
+struct shard_point {
+    uint64_t hash;
+    int member;
+};
+
+struct shard_ring {
+    char *spec;                 // the member list as given
+    char *names;                // a copy of spec cut up for members
+    int member_count;
+    char **members;             // "host:port"
+    struct shard_point *points; // sorted by hash
+    int point_count;
+};
+
+// Builds the ring for a member list. Returns 0, or -1 if the list is
+// malformed (EINVAL) or out of memory.
+int shard_ring_init(struct shard_ring *ring, const char *spec);
+void shard_ring_free(struct shard_ring *ring);
+
+// Index of the member that owns filename
+int shard_owner(const struct shard_ring *ring, const char *filename);
+
+// Splits "host:port" into host (at most host_size bytes) and port.
+// Returns -1 if it has no port.
+int shard_split_address(const char *member, char *host, int host_size, const char **port);
+
+#endif
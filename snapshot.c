@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "wal.h"
+
+#define SNAPSHOT_MAGIC "P4SNAP\r\n"
+#define SNAPSHOT_FORMAT 2
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t format;
+    uint32_t peer_count;
+    uint32_t file_count;
+    uint32_t name_count;
+    uint64_t names_size;
+    uint64_t wal_lsn;       // log position the snapshot covers
+    uint64_t checksum;      // FNV-1a 64 of everything after the header
+};
+
+// ip and port are in network byte order, as the peer connected
+struct snapshot_peer {
+    uint32_t id;
+    uint32_t catalog_version;
+    uint64_t fingerprint;
+    uint32_t ip;
+    uint16_t port;
+    uint16_t reserved;
+    uint32_t file_count;    // this peer's run in the file index array
+    uint32_t reserved2;
+};
+
+static uint64_t checksum(const unsigned char *p, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// ******************************************************************************
+// Writing
+
+struct image {
+    struct peer_entry const **peers;
+    uint32_t peer_count;
+    uint32_t file_count;
+};
+
+static void collect_peer(const struct peer_entry *peer, void *arg) {
+    struct image *img = arg;
+    img->peers[img->peer_count++] = peer;
+    img->file_count += peer->files.count;
+}
+
+static int compare_peer_ids(const void *a, const void *b) {
+    uint32_t x = (*(struct peer_entry const *const *)a)->id;
+    uint32_t y = (*(struct peer_entry const *const *)b)->id;
+    return x < y ? -1 : x > y;
+}
+
+static void count_peer(const struct peer_entry *peer, void *arg) {
+    (void)peer;
+    (*(uint32_t *)arg)++;
+}
+
+// Serializes the registry; the caller holds reg->write_lock
+static unsigned char *build_image(const struct registry *reg, size_t *size, struct snapshot_stats *stats) {
+    const struct catalog *cat = &reg->catalog;
+    struct image img = { NULL, 0, 0 };
+    uint32_t peers = 0;
+    for_each_peer(reg, count_peer, &peers);
+    img.peers = malloc((peers + 1) * sizeof *img.peers);
+    // catalog id -> name table index, for held names only
+    uint32_t *remap = malloc(((size_t)cat->entry_count + 1) * sizeof *remap);
+    if (img.peers == NULL || remap == NULL) {
+        free(img.peers);
+        free(remap);
+        return NULL;
+    }
+    for_each_peer(reg, collect_peer, &img);
+    qsort(img.peers, img.peer_count, sizeof *img.peers, compare_peer_ids);
+
+    uint32_t name_count = 0;
+    uint64_t names_size = 0;
+    for (uint32_t id = 0; id < cat->entry_count; id++) {
+        const struct catalog_entry *e = catalog_entry_by_id(cat, id);
+        if (holder_list_count(catalog_holders(e)) == 0) {
+            remap[id] = CATALOG_NONE;
+            continue;
+        }
+        remap[id] = name_count++;
+        names_size += strlen(e->name) + 1;
+    }
+
+    size_t peers_off = sizeof(struct snapshot_header);
+    size_t files_off = peers_off + (size_t)img.peer_count * sizeof(struct snapshot_peer);
+    size_t names_off = files_off + (size_t)img.file_count * sizeof(uint32_t);
+    *size = names_off + names_size;
+    unsigned char *buf = malloc(*size);
+    if (buf == NULL) {
+        free(img.peers);
+        free(remap);
+        return NULL;
+    }
+
+    struct snapshot_peer *sp = (struct snapshot_peer *)(buf + peers_off);
+    uint32_t *files = (uint32_t *)(buf + files_off);
+    for (uint32_t i = 0; i < img.peer_count; i++) {
+        const struct peer_entry *peer = img.peers[i];
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)&peer->address;
+        memset(&sp[i], 0, sizeof sp[i]);
+        sp[i].id = peer->id;
+        sp[i].catalog_version = peer->catalog_version;
+        sp[i].fingerprint = peer->fingerprint;
+        if (peer->address.ss_family == AF_INET) {
+            sp[i].ip = addr_in->sin_addr.s_addr;
+            sp[i].port = addr_in->sin_port;
+        }
+        sp[i].file_count = peer->files.count;
+        for (int j = 0; j < peer->files.capacity; j++) {
+            uint32_t id = file_set_at(&peer->files, j);
+            if (id != CATALOG_NONE)
+                *files++ = remap[id];
+        }
+    }
+
+    char *names = (char *)(buf + names_off);
+    for (uint32_t id = 0; id < cat->entry_count; id++) {
+        if (remap[id] == CATALOG_NONE)
+            continue;
+        const char *name = catalog_entry_by_id(cat, id)->name;
+        size_t len = strlen(name) + 1;
+        memcpy(names, name, len);
+        names += len;
+    }
+
+    struct snapshot_header *h = (struct snapshot_header *)buf;
+    memset(h, 0, sizeof *h);
+    memcpy(h->magic, SNAPSHOT_MAGIC, sizeof h->magic);
+    h->format = SNAPSHOT_FORMAT;
+    h->peer_count = img.peer_count;
+    h->file_count = img.file_count;
+    h->name_count = name_count;
+    h->names_size = names_size;
+    h->wal_lsn = wal_position(reg->wal);
+
+    stats->peers = img.peer_count;
+    stats->files = img.file_count;
+    stats->names = name_count;
+    stats->bytes = *size;
+    stats->wal_lsn = h->wal_lsn;
+    free(img.peers);
+    free(remap);
+    return buf;
+}
+
+static int write_all(int fd, const unsigned char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int snapshot_write(struct registry *reg, const char *path, struct snapshot_stats *stats) {
+    size_t size;
+    pthread_mutex_lock(&reg->write_lock);
+    unsigned char *buf = build_image(reg, &size, stats);
+    pthread_mutex_unlock(&reg->write_lock);
+    if (buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // checksumming and I/O happen outside the lock
+    struct snapshot_header *h = (struct snapshot_header *)buf;
+    h->checksum = checksum(buf + sizeof *h, size - sizeof *h);
+
+    char tmp[4096];
+    if (snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp) {
+        free(buf);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        free(buf);
+        return -1;
+    }
+    int rc = write_all(fd, buf, size);
+    free(buf);
+    if (rc == 0)
+        rc = fsync(fd);
+    if (close(fd) == -1)
+        rc = -1;
+    if (rc == 0)
+        rc = rename(tmp, path);
+    if (rc == -1) {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+    }
+    return rc;
+}
+
+// ******************************************************************************
+// Loading
+
+// Checks that the mapped file is a whole, uncorrupted snapshot and fills
+// names[] with a pointer to every name
+static int validate(const unsigned char *map, size_t size, const char ***names_out) {
+    const struct snapshot_header *h = (const struct snapshot_header *)map;
+    if (size < sizeof *h || memcmp(h->magic, SNAPSHOT_MAGIC, sizeof h->magic) != 0 ||
+        h->format != SNAPSHOT_FORMAT)
+        return -1;
+    uint64_t expect = sizeof *h + (uint64_t)h->peer_count * sizeof(struct snapshot_peer) +
+        (uint64_t)h->file_count * sizeof(uint32_t) + h->names_size;
+    if (expect != size || checksum(map + sizeof *h, size - sizeof *h) != h->checksum)
+        return -1;
+
+    const struct snapshot_peer *sp = (const struct snapshot_peer *)(map + sizeof *h);
+    const uint32_t *files = (const uint32_t *)(sp + h->peer_count);
+    uint64_t file_total = 0;
+    for (uint32_t i = 0; i < h->peer_count; i++) {
+        if (i > 0 && sp[i].id < sp[i - 1].id)
+            return -1;
+        file_total += sp[i].file_count;
+    }
+    if (file_total != h->file_count)
+        return -1;
+    for (uint32_t i = 0; i < h->file_count; i++) {
+        if (files[i] >= h->name_count)
+            return -1;
+    }
+
+    const char **names = malloc(((size_t)h->name_count + 1) * sizeof *names);
+    if (names == NULL)
+        return -1;
+    const char *p = (const char *)(files + h->file_count);
+    const char *end = p + h->names_size;
+    for (uint32_t i = 0; i < h->name_count; i++) {
+        const char *nul = memchr(p, '\0', end - p);
+        if (nul == NULL) {
+            free(names);
+            return -1;
+        }
+        names[i] = p;
+        p = nul + 1;
+    }
+    *names_out = names;
+    return 0;
+}
+
+int snapshot_load(struct registry *reg, const char *path, struct snapshot_stats *stats) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    size_t size = st.st_size;
+    const unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const char **names;
+    if (validate(map, size, &names) == -1) {
+        munmap((void *)map, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    const struct snapshot_header *h = (const struct snapshot_header *)map;
+    const struct snapshot_peer *sp = (const struct snapshot_peer *)(map + sizeof *h);
+    const uint32_t *files = (const uint32_t *)(sp + h->peer_count);
+    int rc = 0;
+    for (uint32_t i = 0; i < h->peer_count && rc == 0; i++) {
+        struct sockaddr_storage addr;
+        memset(&addr, 0, sizeof addr);
+        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
+        addr_in->sin_family = AF_INET;
+        addr_in->sin_addr.s_addr = sp[i].ip;
+        addr_in->sin_port = sp[i].port;
+
+        struct peer_entry *ghost = add_ghost(reg, sp[i].id, &addr);
+        if (ghost == NULL) {
+            rc = -1;
+            break;
+        }
+        for (uint32_t j = 0; j < sp[i].file_count; j++) {
+            if (publish_file(reg, ghost, names[*files++]) == -1) {
+                rc = -1;
+                break;
+            }
+        }
+        ghost->catalog_version = sp[i].catalog_version;
+        ghost->fingerprint = sp[i].fingerprint;
+    }
+
+    stats->peers = h->peer_count;
+    stats->files = h->file_count;
+    stats->names = h->name_count;
+    stats->bytes = size;
+    stats->wal_lsn = h->wal_lsn;
+    free(names);
+    munmap((void *)map, size);
+    if (rc == -1)
+        errno = ENOMEM;
+    return rc;
+}
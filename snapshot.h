@@ -0,0 +1,42 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "registry.h"
+
+/*
+ * Binary snapshots of the peer table and catalog for warm restarts.
+ *
+ * A snapshot is one file, in host byte order, laid out so it can be mmap'd
+ * and used in place: a fixed header, then one fixed-size record per peer
+ * (sorted by peer id), then every peer's files as uint32 indexes into the
+ * name table, then the name table of null-terminated filenames. Only names
+ * someone holds are written. A checksum over everything after the header
+ * catches torn or corrupt files. The header also records how far into the
+ * write-ahead log (see wal.h) the snapshot reaches.
+ *
+ * Loaded peers come back as ghosts (see registry.h): SEARCH finds their
+ * files right away, and a peer that re-JOINs with the same id picks its
+ * list back up, catalog version included, so it doesn't need to PUBLISH
+ * again.
+ */
+
+struct snapshot_stats {
+    uint32_t peers;
+    uint32_t files;     // (peer, file) pairs
+    uint32_t names;
+    uint64_t bytes;
+    uint64_t wal_lsn;   // log records from here on are newer
+};
+
+// Writes reg to path atomically: a temporary file is written and synced,
+// then renamed over path. Takes reg->write_lock only while the image is
+// built in memory. Returns 0 on success, -1 with errno set.
+int snapshot_write(struct registry *reg, const char *path, struct snapshot_stats *stats);
+
+// Loads the snapshot at path into an empty registry before any worker
+// starts. Returns 0 on success, -1 with errno set (ENOENT if there is no
+// snapshot, EINVAL if it is corrupt, in which case reg is untouched).
+int snapshot_load(struct registry *reg, const char *path, struct snapshot_stats *stats);
+
+#endif
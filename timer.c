@@ -0,0 +1,111 @@
+#include <string.h>
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define MAX_TICKS ((1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ns) {
+    memset(wheel, 0, sizeof *wheel);
+    wheel->now = now_ns / TIMER_TICK_NS;
+}
+
+void timer_init(struct timer *t, void (*fire)(struct timer *t, void *arg)) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->fire = fire;
+}
+
+static void link_timer(struct timer_wheel *wheel, struct timer *t) {
+    uint64_t delta = t->expires - wheel->now;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= 1ULL << (TIMER_SLOT_BITS * (level + 1)))
+        level++;
+    struct timer **slot = &wheel->slots[level][(t->expires >> (TIMER_SLOT_BITS * level)) & SLOT_MASK];
+    t->next = *slot;
+    if (t->next != NULL)
+        t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void unlink_timer(struct timer *t) {
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+void timer_schedule(struct timer_wheel *wheel, struct timer *t, uint64_t at_ns) {
+    if (timer_pending(t))
+        timer_cancel(wheel, t);
+    uint64_t expires = (at_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+    if (expires - wheel->now > MAX_TICKS)
+        expires = wheel->now + MAX_TICKS;
+    t->expires = expires;
+    link_timer(wheel, t);
+    wheel->count++;
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *t) {
+    if (!timer_pending(t))
+        return;
+    unlink_timer(t);
+    wheel->count--;
+}
+
+// Moves the timers of one slot down to the levels below
+static void cascade(struct timer_wheel *wheel, int level) {
+    struct timer **slot = &wheel->slots[level][(wheel->now >> (TIMER_SLOT_BITS * level)) & SLOT_MASK];
+    struct timer *t = *slot;
+    *slot = NULL;
+    while (t != NULL) {
+        struct timer *next = t->next;
+        link_timer(wheel, t);
+        t = next;
+    }
+}
+
+void timer_advance(struct timer_wheel *wheel, uint64_t now_ns, void *arg) {
+    uint64_t target = now_ns / TIMER_TICK_NS;
+    while (wheel->now < target) {
+        if (wheel->count == 0) {
+            wheel->now = target;
+            return;
+        }
+        wheel->now++;
+        // entering a new span of a level brings its slot down a level
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if ((wheel->now & ((1ULL << (TIMER_SLOT_BITS * level)) - 1)) != 0)
+                break;
+            cascade(wheel, level);
+        }
+        // level 0 slots now only hold timers due this tick. Fired timers
+        // may cancel others in the same slot, so take them one at a time.
+        struct timer **slot = &wheel->slots[0][wheel->now & SLOT_MASK];
+        while (*slot != NULL) {
+            struct timer *t = *slot;
+            unlink_timer(t);
+            wheel->count--;
+            t->fire(t, arg);
+        }
+    }
+}
+
+int timer_next_ms(const struct timer_wheel *wheel, uint64_t now_ns) {
+    if (wheel->count == 0)
+        return -1;
+    // the first non-empty level 0 slot, or else the next cascade
+    uint64_t ticks = TIMER_SLOTS - (wheel->now & SLOT_MASK);
+    for (uint64_t i = 1; i < ticks; i++) {
+        if (wheel->slots[0][(wheel->now + i) & SLOT_MASK] != NULL) {
+            ticks = i;
+            break;
+        }
+    }
+    uint64_t at = (wheel->now + ticks) * TIMER_TICK_NS;
+    return at <= now_ns ? 0 : (int)((at - now_ns + 999999) / 1000000);
+}
@@ -0,0 +1,55 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel, one per worker.
+ *
+ * Time advances in ticks of TIMER_TICK_NS. Level 0 has one slot per tick
+ * for the next TIMER_SLOTS ticks; each level above covers TIMER_SLOTS times
+ * the span of the one below, and its slots are cascaded down a level as
+ * time reaches them. Scheduling and cancelling are O(1) list operations,
+ * and advancing costs one slot per tick plus the timers that fire or move,
+ * so nothing ever scans all connections.
+ *
+ * Timers are intrusive: the owner embeds a struct timer and recovers itself
+ * from the pointer handed to fire().
+ */
+
+#define TIMER_TICK_NS 100000000ULL      // 100 ms
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4                  // 64^4 ticks: about 19 days
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;   // NULL while not scheduled
+    uint64_t expires;       // tick
+    void (*fire)(struct timer *t, void *arg);
+};
+
+struct timer_wheel {
+    uint64_t now;           // current tick
+    int count;              // timers scheduled
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ns);
+
+void timer_init(struct timer *t, void (*fire)(struct timer *t, void *arg));
+static inline int timer_pending(const struct timer *t) {
+    return t->pprev != NULL;
+}
+// (Re)schedules t to fire at the first tick at or after at_ns
+void timer_schedule(struct timer_wheel *wheel, struct timer *t, uint64_t at_ns);
+void timer_cancel(struct timer_wheel *wheel, struct timer *t);
+
+// Fires, in tick order, every timer due by now_ns, passing arg along.
+// A timer is unscheduled before it fires, so fire() may schedule it again.
+void timer_advance(struct timer_wheel *wheel, uint64_t now_ns, void *arg);
+// Milliseconds until the next tick that has work (a timer to fire or a
+// slot to cascade), for the event loop's wait; -1 if nothing is scheduled
+int timer_next_ms(const struct timer_wheel *wheel, uint64_t now_ns);
+
+#endif
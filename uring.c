@@ -0,0 +1,198 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+#define CQ_PER_SQ 16    // completion queue size as a multiple of the submission queue
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// One mapping holds both rings (IORING_FEAT_SINGLE_MMAP), another the
+// submission entries
+static int map_rings(struct uring *u, const struct io_uring_params *p) {
+    size_t sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    size_t cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED)
+        return -1;
+    u->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        munmap(u->ring, u->ring_size);
+        u->ring = NULL;
+        return -1;
+    }
+
+    char *ring = u->ring;
+    u->sq_head = (unsigned *)(ring + p->sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p->sq_off.tail);
+    u->sq_mask = *(unsigned *)(ring + p->sq_off.ring_mask);
+    u->sq_array = (unsigned *)(ring + p->sq_off.array);
+    u->sq_entries = p->sq_entries;
+    u->cq_head = (unsigned *)(ring + p->cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p->cq_off.tail);
+    u->cq_mask = *(unsigned *)(ring + p->cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p->cq_off.cqes);
+    // entry i of the array always names sqe i; the tail alone says what's new
+    for (unsigned i = 0; i < u->sq_entries; i++)
+        u->sq_array[i] = i;
+    return 0;
+}
+
+static int register_buffers(struct uring *u, unsigned count, unsigned size) {
+    u->buf_count = count;
+    u->buf_size = size;
+    u->buf_ring = mmap(NULL, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buf_ring == MAP_FAILED) {
+        u->buf_ring = NULL;
+        return -1;
+    }
+    u->bufs = malloc((size_t)count * size);
+    if (u->bufs == NULL)
+        return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return -1;
+    u->buf_tail = 0;
+    for (unsigned i = 0; i < count; i++)
+        uring_recycle(u, i);
+    return 0;
+}
+
+int uring_init(struct uring *u, unsigned entries, unsigned buf_count, unsigned buf_size) {
+    memset(u, 0, sizeof *u);
+    u->fd = -1;
+    if (buf_count == 0 || (buf_count & (buf_count - 1)) != 0 || buf_count > 32768) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Only the owning thread submits, and it collects completions when it
+    // waits, so the kernel can skip cross-thread wakeups. Older kernels
+    // refuse those flags and get a plain ring.
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * CQ_PER_SQ;
+    u->fd = sys_setup(entries, &p);
+    if (u->fd == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof p);
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * CQ_PER_SQ;
+        u->fd = sys_setup(entries, &p);
+    }
+    if (u->fd == -1)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        close(u->fd);
+        u->fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+    if (map_rings(u, &p) == -1 || register_buffers(u, buf_count, buf_size) == -1) {
+        int saved = errno;
+        uring_close(u);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+void uring_close(struct uring *u) {
+    if (u->fd == -1)
+        return;
+    if (u->sqes != NULL && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+    if (u->ring != NULL && u->ring != MAP_FAILED)
+        munmap(u->ring, u->ring_size);
+    close(u->fd);
+    if (u->buf_ring != NULL)
+        munmap(u->buf_ring, u->buf_count * sizeof(struct io_uring_buf));
+    free(u->bufs);
+    u->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *u) {
+    unsigned tail = *u->sq_tail + u->sq_queued;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if (uring_enter(u, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return NULL;
+        tail = *u->sq_tail + u->sq_queued;
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    u->sq_queued++;
+    return sqe;
+}
+
+int uring_enter(struct uring *u, int timeout_ms) {
+    unsigned submit = u->sq_queued;
+    if (submit > 0) {
+        __atomic_store_n(u->sq_tail, *u->sq_tail + submit, __ATOMIC_RELEASE);
+        u->sq_queued = 0;
+    }
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    // GETEVENTS even when not waiting, so deferred completions get posted
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    unsigned wait = timeout_ms != 0 && uring_peek(u) == NULL ? 1 : 0;
+    int rc = sys_enter(u->fd, submit, wait, flags, &arg, sizeof arg);
+    u->enters++;
+    return rc < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_peek(struct uring *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & u->cq_mask];
+}
+
+void uring_seen(struct uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned char *uring_buffer(struct uring *u, unsigned id) {
+    return u->bufs + (size_t)id * u->buf_size;
+}
+
+void uring_recycle(struct uring *u, unsigned id) {
+    struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (u->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(u, id);
+    buf->len = u->buf_size;
+    buf->bid = id;
+    u->buf_tail++;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
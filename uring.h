@@ -0,0 +1,70 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring, set up with the raw system calls (no liburing).
+ *
+ * Requests are written into the submission queue with uring_get_sqe() and
+ * handed to the kernel together by the next uring_enter(), which also waits
+ * for completions; one system call covers a whole batch in both directions.
+ * Receives pick their memory from a ring of provided buffers registered
+ * with the kernel, so a multishot recv needs no buffer of its own and keeps
+ * delivering until it is cancelled or runs out of buffers.
+ */
+
+struct uring {
+    int fd;
+    // submission queue, shared with the kernel
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_queued;             // filled in but not yet passed to uring_enter()
+    struct io_uring_sqe *sqes;
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+    // provided buffers, group URING_BUF_GROUP
+    struct io_uring_buf_ring *buf_ring;
+    unsigned char *bufs;
+    unsigned buf_count;
+    unsigned buf_size;
+    uint16_t buf_tail;
+    uint64_t enters;                // io_uring_enter() calls made, for metrics
+};
+
+#define URING_BUF_GROUP 0
+
+// Creates a ring with room for entries submissions and registers buf_count
+// buffers of buf_size bytes (buf_count a power of two). Returns 0, or -1
+// with errno set, e.g. ENOSYS or EINVAL when the kernel is too old.
+int uring_init(struct uring *u, unsigned entries, unsigned buf_count, unsigned buf_size);
+void uring_close(struct uring *u);
+
+// Returns a zeroed submission entry. When the queue is full the queued ones
+// are submitted first, so this only fails (NULL) if the kernel refuses them.
+struct io_uring_sqe *uring_get_sqe(struct uring *u);
+
+// Submits everything queued and waits up to timeout_ms (-1 blocks, 0 only
+// submits) for at least one completion. Returns 0 or -1 with errno set;
+// ETIME and EINTR just mean nothing completed.
+int uring_enter(struct uring *u, int timeout_ms);
+
+// The oldest completion not yet seen, or NULL
+struct io_uring_cqe *uring_peek(struct uring *u);
+void uring_seen(struct uring *u);
+
+// The data of a provided buffer picked by a completion, and giving it back
+unsigned char *uring_buffer(struct uring *u, unsigned id);
+void uring_recycle(struct uring *u, unsigned id);
+
+#endif
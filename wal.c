@@ -0,0 +1,784 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "logger.h"
+#include "protocol.h"
+#include "registry.h"
+#include "wal.h"
+
+#define WAL_MAGIC "P4WAL\r\n"
+#define WAL_MAX_BUFFER (64 * 1024 * 1024)   // appenders wait beyond this
+#define WAL_COPY_CHUNK (1024 * 1024)
+#define REPLICA_MAX_BACKLOG (64 * 1024 * 1024)  // a replica this far behind is dropped
+#define WAL_MAX_RECORD (64 * 1024 * 1024)       // larger lengths mean a corrupt stream
+
+// A replica connection fed by its own thread. The writer appends each synced
+// batch to buf; the thread sends the dump, then drains buf.
+struct replica {
+    struct replica *next;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    unsigned char *dump;
+    size_t dump_len;
+    unsigned char *buf;
+    size_t len;
+    size_t capacity;
+    uint64_t start_lsn;     // records before this are in the dump
+    int fd;
+    int dead;               // the thread has stopped, or should
+    pthread_t thread;
+};
+
+// File header; records start right after it
+struct wal_header {
+    char magic[8];
+    uint64_t base_lsn;
+};
+
+static uint32_t checksum(const unsigned char *p, size_t len) {
+    uint32_t h = 0x811c9dc5u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x01000193u;
+    }
+    return h;
+}
+
+// Syncs the directory holding path so a rename into it is durable
+static int sync_dir(const char *path) {
+    char *copy = strdup(path);
+    if (copy == NULL)
+        return -1;
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(copy);
+    if (fd == -1)
+        return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+static int write_all(int fd, const unsigned char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Creates path.tmp holding a header for base_lsn. Returns its fd, or -1.
+static int create_tmp(const char *path, uint64_t base_lsn, char *tmp, size_t tmp_size) {
+    if (snprintf(tmp, tmp_size, "%s.tmp", path) >= (int)tmp_size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+    struct wal_header h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, WAL_MAGIC, sizeof h.magic);
+    h.base_lsn = base_lsn;
+    if (write_all(fd, (const unsigned char *)&h, sizeof h) == -1) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    return fd;
+}
+
+// Moves a finished path.tmp over path. Returns fd, or -1 after closing it.
+static int install_tmp(int fd, const char *tmp, const char *path) {
+    if (fsync(fd) == -1 || rename(tmp, path) == -1 || sync_dir(path) == -1) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+// ******************************************************************************
+// Replay
+
+// Returns -1 unless data is a run of null-terminated names
+static int check_names(const unsigned char *data, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        const unsigned char *nul = memchr(data + off, '\0', len - off);
+        if (nul == NULL || nul - (data + off) >= MAX_FILENAME_LEN)
+            return -1;
+        off = nul - data + 1;
+    }
+    return 0;
+}
+
+// Returns -1 unless payload is a well-formed record that apply() can take
+static int check_record(const unsigned char *payload, size_t len) {
+    const unsigned char *data = payload + WAL_PAYLOAD_HEADER;
+    len -= WAL_PAYLOAD_HEADER;
+    switch (payload[0]) {
+    case WAL_JOIN:
+        return len == 6 ? 0 : -1;
+    case WAL_PUBLISH:
+    case WAL_PUBLISH_ADD:
+    case WAL_PUBLISH_REMOVE:
+        return check_names(data, len);
+    case WAL_LEAVE:
+        return 0;
+    }
+    return -1;
+}
+
+// The ghost for peer_id, created without an address if the log has no JOIN
+// for it (the JOIN was covered by the snapshot)
+static struct peer_entry *ghost_for(struct registry *reg, uint32_t peer_id) {
+    struct peer_entry *ghost = find_ghost(reg, peer_id);
+    if (ghost == NULL) {
+        struct sockaddr_storage addr;
+        memset(&addr, 0, sizeof addr);
+        addr.ss_family = AF_INET;
+        ghost = add_ghost(reg, peer_id, &addr);
+    }
+    return ghost;
+}
+
+// Applies one record. Returns -1 if it is malformed or out of memory.
+static int apply(struct registry *reg, const unsigned char *payload, size_t len) {
+    int type = payload[0];
+    uint32_t peer_id;
+    memcpy(&peer_id, payload + 1, 4);
+    const unsigned char *data = payload + WAL_PAYLOAD_HEADER;
+    len -= WAL_PAYLOAD_HEADER;
+
+    switch (type) {
+    case WAL_JOIN: {
+        if (len != 6)
+            return -1;
+        struct sockaddr_storage addr;
+        memset(&addr, 0, sizeof addr);
+        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
+        addr_in->sin_family = AF_INET;
+        memcpy(&addr_in->sin_addr.s_addr, data, 4);
+        memcpy(&addr_in->sin_port, data + 4, 2);
+        return add_ghost(reg, peer_id, &addr) == NULL ? -1 : 0;
+    }
+
+    case WAL_PUBLISH:
+    case WAL_PUBLISH_ADD:
+    case WAL_PUBLISH_REMOVE: {
+        if (check_names(data, len) == -1)
+            return -1;
+        struct peer_entry *ghost = ghost_for(reg, peer_id);
+        if (ghost == NULL)
+            return -1;
+        if (type == WAL_PUBLISH)
+            unpublish_all(reg, ghost);
+        for (size_t off = 0; off < len; off += strlen((const char *)data + off) + 1) {
+            const char *name = (const char *)data + off;
+            int rc = type == WAL_PUBLISH_REMOVE ? unpublish_file(reg, ghost, name) : publish_file(reg, ghost, name);
+            if (rc == -1)
+                return -1;
+        }
+        ghost->catalog_version++;
+        return 0;
+    }
+
+    case WAL_LEAVE:
+        remove_ghost(reg, peer_id);
+        return 0;
+    }
+    return -1;
+}
+
+long wal_replay(struct registry *reg, const char *path, uint64_t lsn, uint64_t *end_lsn) {
+    *end_lsn = lsn;
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(struct wal_header)) {
+        close(fd);      // never got its header; wal_open starts a new one
+        return 0;
+    }
+    const unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+
+    const struct wal_header *h = (const struct wal_header *)map;
+    if (memcmp(h->magic, WAL_MAGIC, sizeof h->magic) != 0) {
+        munmap((void *)map, size);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    long applied = 0;
+    size_t off = sizeof *h;
+    while (off + WAL_RECORD_HEADER <= size) {
+        uint32_t len, sum;
+        memcpy(&len, map + off, 4);
+        memcpy(&sum, map + off + 4, 4);
+        const unsigned char *payload = map + off + WAL_RECORD_HEADER;
+        if (len < WAL_PAYLOAD_HEADER || len > size - off - WAL_RECORD_HEADER || checksum(payload, len) != sum)
+            break;      // torn tail
+        if (h->base_lsn + (off - sizeof *h) >= lsn) {
+            if (apply(reg, payload, len) == -1) {
+                munmap((void *)map, size);
+                close(fd);
+                errno = EINVAL;
+                return -1;
+            }
+            applied++;
+        }
+        off += WAL_RECORD_HEADER + len;
+    }
+
+    // cut off a partial record so new appends follow the last good one
+    int rc = off < size ? ftruncate(fd, off) : 0;
+    uint64_t file_end = h->base_lsn + (off - sizeof *h);
+    if (file_end > *end_lsn)
+        *end_lsn = file_end;
+    munmap((void *)map, size);
+    close(fd);
+    return rc == -1 ? -1 : applied;
+}
+
+// ******************************************************************************
+// Writing
+
+
+// Writes a record at rec, which has room for WAL_RECORD_HEADER +
+// WAL_PAYLOAD_HEADER + len bytes
+static void encode(unsigned char *rec, int type, uint32_t peer_id, const void *data, size_t len) {
+    unsigned char *p = rec + WAL_RECORD_HEADER;
+    uint32_t payload_len = WAL_PAYLOAD_HEADER + len;
+    p[0] = type;
+    memcpy(p + 1, &peer_id, 4);
+    if (len > 0)
+        memcpy(p + WAL_PAYLOAD_HEADER, data, len);
+    uint32_t sum = checksum(p, payload_len);
+    memcpy(rec, &payload_len, 4);
+    memcpy(rec + 4, &sum, 4);
+}
+
+// Grows *buf to hold at least need bytes
+static int reserve(unsigned char **buf, size_t *capacity, size_t need) {
+    if (need <= *capacity)
+        return 0;
+    size_t capacity_new = *capacity ? *capacity : 64 * 1024;
+    while (capacity_new < need)
+        capacity_new *= 2;
+    unsigned char *p = realloc(*buf, capacity_new);
+    if (p == NULL)
+        return -1;
+    *buf = p;
+    *capacity = capacity_new;
+    return 0;
+}
+
+// The peer's names back to back, null-terminated, or NULL if out of memory
+static char *peer_names(const struct registry *reg, const struct peer_entry *peer, size_t *len) {
+    *len = 0;
+    for (int i = 0; i < peer->files.capacity; i++) {
+        uint32_t id = file_set_at(&peer->files, i);
+        if (id != CATALOG_NONE)
+            *len += strlen(catalog_entry_by_id(&reg->catalog, id)->name) + 1;
+    }
+    char *names = malloc(*len + 1);
+    if (names == NULL)
+        return NULL;
+    char *p = names;
+    for (int i = 0; i < peer->files.capacity; i++) {
+        uint32_t id = file_set_at(&peer->files, i);
+        if (id == CATALOG_NONE)
+            continue;
+        const char *name = catalog_entry_by_id(&reg->catalog, id)->name;
+        size_t n = strlen(name) + 1;
+        memcpy(p, name, n);
+        p += n;
+    }
+    return names;
+}
+
+// ******************************************************************************
+// Replicas
+
+static int send_all(int fd, const unsigned char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *replica_run(void *arg) {
+    struct replica *r = arg;
+    int rc = send_all(r->fd, r->dump, r->dump_len);
+    free(r->dump);
+    r->dump = NULL;
+
+    unsigned char *spare = NULL;
+    size_t spare_capacity = 0;
+    pthread_mutex_lock(&r->lock);
+    while (rc == 0) {
+        while (r->len == 0 && !r->dead)
+            pthread_cond_wait(&r->wake, &r->lock);
+        if (r->dead)
+            break;
+        unsigned char *batch = r->buf;
+        size_t batch_len = r->len;
+        size_t batch_capacity = r->capacity;
+        r->buf = spare;
+        r->capacity = spare_capacity;
+        r->len = 0;
+        pthread_mutex_unlock(&r->lock);
+
+        rc = send_all(r->fd, batch, batch_len);
+        spare = batch;
+        spare_capacity = batch_capacity;
+        pthread_mutex_lock(&r->lock);
+    }
+    r->dead = 1;
+    pthread_mutex_unlock(&r->lock);
+    free(spare);
+    return NULL;
+}
+
+// Stops a replica's thread and frees it
+static void replica_free(struct replica *r) {
+    pthread_mutex_lock(&r->lock);
+    r->dead = 1;
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+    shutdown(r->fd, SHUT_RDWR);     // unblocks a send in progress
+    pthread_join(r->thread, NULL);
+    close(r->fd);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->wake);
+    free(r->dump);
+    free(r->buf);
+    free(r);
+}
+
+// Hands a synced batch covering [lsn, lsn + len) to every replica, and
+// drops replicas that died or fell too far behind. Called with w->lock held.
+static void ship(struct wal *w, const unsigned char *batch, size_t len, uint64_t lsn) {
+    struct replica **link = &w->replicas;
+    while (*link != NULL) {
+        struct replica *r = *link;
+        pthread_mutex_lock(&r->lock);
+        // a replica that attached mid-batch already has the start in its dump
+        size_t skip = r->start_lsn > lsn ? r->start_lsn - lsn : 0;
+        if (!r->dead && skip < len) {
+            if (r->len + len - skip > REPLICA_MAX_BACKLOG || reserve(&r->buf, &r->capacity, r->len + len - skip) == -1) {
+                r->dead = 1;
+            } else {
+                memcpy(r->buf + r->len, batch + skip, len - skip);
+                r->len += len - skip;
+                pthread_cond_signal(&r->wake);
+            }
+        }
+        int dead = r->dead;
+        pthread_mutex_unlock(&r->lock);
+        if (dead) {
+            *link = r->next;
+            replica_free(r);
+            log_printf(LOG_WARN, "[WARN] Replica dropped\n");
+        } else {
+            link = &r->next;
+        }
+    }
+}
+
+
+struct dump {
+    const struct registry *reg;
+    unsigned char *buf;
+    size_t len;
+    size_t capacity;
+    int failed;
+};
+
+static void dump_record(struct dump *d, int type, uint32_t peer_id, const void *data, size_t len) {
+    size_t record = WAL_RECORD_HEADER + WAL_PAYLOAD_HEADER + len;
+    if (d->failed || reserve(&d->buf, &d->capacity, d->len + record) == -1) {
+        d->failed = 1;
+        return;
+    }
+    encode(d->buf + d->len, type, peer_id, data, len);
+    d->len += record;
+}
+
+static void dump_peer(const struct peer_entry *peer, void *arg) {
+    struct dump *d = arg;
+    const struct sockaddr_in *addr_in = (const struct sockaddr_in *)&peer->address;
+    unsigned char address[6];
+    memcpy(address, &addr_in->sin_addr.s_addr, 4);
+    memcpy(address + 4, &addr_in->sin_port, 2);
+    dump_record(d, WAL_JOIN, peer->id, address, sizeof address);
+    if (peer->files.count == 0)
+        return;
+    size_t names_len;
+    char *names = peer_names(d->reg, peer, &names_len);
+    if (names == NULL) {
+        d->failed = 1;
+        return;
+    }
+    dump_record(d, WAL_PUBLISH, peer->id, names, names_len);
+    free(names);
+}
+
+// The registry as records: a JOIN for every peer, and a PUBLISH of its list
+// for those that have files
+static unsigned char *dump_registry(const struct registry *reg, size_t *len) {
+    struct dump d = { reg, NULL, 0, 0, 0 };
+    for_each_peer(reg, dump_peer, &d);
+    if (d.failed) {
+        free(d.buf);
+        return NULL;
+    }
+    *len = d.len;
+    return d.buf;
+}
+
+int wal_add_replica(struct wal *w, const struct registry *reg, int fd) {
+    struct replica *r = calloc(1, sizeof *r);
+    if (r == NULL)
+        return -1;
+    r->fd = fd;
+    r->dump = dump_registry(reg, &r->dump_len);
+    if (r->dump == NULL && reg->peer_count + reg->ghost_count > 0) {
+        free(r);
+        return -1;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+
+    pthread_mutex_lock(&w->lock);
+    r->start_lsn = w->end_lsn;
+    if (pthread_create(&r->thread, NULL, replica_run, r) != 0) {
+        pthread_mutex_unlock(&w->lock);
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->wake);
+        free(r->dump);
+        free(r);
+        return -1;
+    }
+    r->next = w->replicas;
+    w->replicas = r;
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+int wal_log_records(struct wal *w, const unsigned char *buf, size_t len, size_t *used) {
+    size_t off = 0;
+    while (off + WAL_RECORD_HEADER <= len) {
+        uint32_t n, sum;
+        memcpy(&n, buf + off, 4);
+        memcpy(&sum, buf + off + 4, 4);
+        if (n < WAL_PAYLOAD_HEADER || n > WAL_MAX_RECORD)
+            return -1;
+        if (n > len - off - WAL_RECORD_HEADER)
+            break;      // the rest hasn't arrived yet
+        const unsigned char *payload = buf + off + WAL_RECORD_HEADER;
+        if (checksum(payload, n) != sum || check_record(payload, n) == -1)
+            return -1;
+        uint32_t peer_id;
+        memcpy(&peer_id, payload + 1, 4);
+        wal_append(w, payload[0], peer_id, payload + WAL_PAYLOAD_HEADER, n - WAL_PAYLOAD_HEADER);
+        off += WAL_RECORD_HEADER + n;
+    }
+    *used = off;
+    return 0;
+}
+
+int wal_apply_records(struct registry *reg, const unsigned char *buf, size_t len) {
+    for (size_t off = 0; off < len;) {
+        uint32_t n;
+        memcpy(&n, buf + off, 4);
+        if (apply(reg, buf + off + WAL_RECORD_HEADER, n) == -1)
+            return -1;
+        off += WAL_RECORD_HEADER + n;
+    }
+    return 0;
+}
+
+// ******************************************************************************
+// Writing
+
+// Rewrites the log to start at lsn; runs on the writer thread, which owns fd
+static int compact(struct wal *w, uint64_t lsn) {
+    char tmp[4096];
+    int fd = create_tmp(w->path, lsn, tmp, sizeof tmp);
+    if (fd == -1)
+        return -1;
+
+    unsigned char *chunk = malloc(WAL_COPY_CHUNK);
+    off_t from = sizeof(struct wal_header) + (lsn - w->base_lsn);
+    off_t end = lseek(w->fd, 0, SEEK_END);
+    int rc = chunk == NULL || end == -1 ? -1 : 0;
+    while (rc == 0 && from < end) {
+        ssize_t n = pread(w->fd, chunk, end - from < WAL_COPY_CHUNK ? end - from : WAL_COPY_CHUNK, from);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || write_all(fd, chunk, n) == -1)
+            rc = -1;
+        from += n;
+    }
+    free(chunk);
+    if (rc == -1) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    if (install_tmp(fd, tmp, w->path) == -1)
+        return -1;
+    close(w->fd);
+    w->fd = fd;
+    return 0;
+}
+
+static void *wal_run(void *arg) {
+    struct wal *w = arg;
+    unsigned char *spare = NULL;
+    size_t spare_capacity = 0;
+
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        while (w->len == 0 && !w->stopping && w->compact_lsn <= w->base_lsn)
+            pthread_cond_wait(&w->wake, &w->lock);
+        if (w->len == 0 && w->stopping)
+            break;
+
+        // take everything appended so far as one batch; appends continue
+        // into the other buffer while it is written
+        unsigned char *batch = w->buf;
+        size_t batch_len = w->len;
+        size_t batch_capacity = w->capacity;
+        uint64_t end = w->end_lsn;
+        uint64_t asked = w->compact_lsn;
+        uint64_t compact_to = asked < end ? asked : end;
+        w->buf = spare;
+        w->capacity = spare_capacity;
+        w->len = 0;
+        pthread_mutex_unlock(&w->lock);
+
+        int rc = 0;
+        int compacted = 0;
+        if (w->fd != -1 && batch_len > 0 && (write_all(w->fd, batch, batch_len) == -1 || fdatasync(w->fd) == -1))
+            rc = -1;
+        if (rc == 0 && compact_to > w->base_lsn) {
+            if (compact(w, compact_to) == 0)
+                compacted = 1;
+            else
+                log_printf(LOG_WARN, "[WARN] Compacting log %s failed: %s\n", w->path, strerror(errno));
+        }
+        if (rc == -1)
+            log_printf(LOG_ERROR, "[ERROR] Writing log %s failed, logging stopped: %s\n", w->path, strerror(errno));
+
+        pthread_mutex_lock(&w->lock);
+        if (rc == -1)
+            w->failed = 1;
+        if (compacted)
+            w->base_lsn = compact_to;
+        else if (compact_to > w->base_lsn && w->compact_lsn == asked)
+            // not retried straight away: the next snapshot asks again
+            w->compact_lsn = w->base_lsn;
+        // replicas only ever see what is durable here
+        if (rc == 0 && batch_len > 0)
+            ship(w, batch, batch_len, end - batch_len);
+        w->durable_lsn = end;
+        w->batches += w->fd != -1 && batch_len > 0;
+        spare = batch;
+        spare_capacity = batch_capacity;
+        pthread_cond_broadcast(&w->space);
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(spare);
+    return NULL;
+}
+
+int wal_open(struct wal *w, const char *path, uint64_t end_lsn) {
+    memset(w, 0, sizeof *w);
+    w->fd = -1;
+    w->base_lsn = end_lsn;
+    if (path != NULL) {
+        w->path = strdup(path);
+        if (w->path == NULL)
+            return -1;
+
+        // append to the existing file if replay left it ending at end_lsn,
+        // otherwise start a new one there
+        struct wal_header h;
+        w->fd = open(path, O_RDWR | O_CLOEXEC);
+        if (w->fd != -1) {
+            off_t size = lseek(w->fd, 0, SEEK_END);
+            if (pread(w->fd, &h, sizeof h, 0) != sizeof h || memcmp(h.magic, WAL_MAGIC, sizeof h.magic) != 0 ||
+                h.base_lsn + (size - sizeof h) != end_lsn) {
+                close(w->fd);
+                w->fd = -1;
+            } else {
+                w->base_lsn = h.base_lsn;
+            }
+        }
+        if (w->fd == -1) {
+            char tmp[4096];
+            int fd = create_tmp(path, end_lsn, tmp, sizeof tmp);
+            if (fd == -1 || (w->fd = install_tmp(fd, tmp, path)) == -1) {
+                free(w->path);
+                return -1;
+            }
+        }
+    }
+
+    w->end_lsn = w->durable_lsn = end_lsn;
+    w->compact_lsn = w->base_lsn;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    pthread_cond_init(&w->space, NULL);
+    if (pthread_create(&w->thread, NULL, wal_run, w) != 0) {
+        if (w->fd != -1)
+            close(w->fd);
+        free(w->path);
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+void wal_close(struct wal *w) {
+    pthread_mutex_lock(&w->lock);
+    w->stopping = 1;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    while (w->replicas != NULL) {
+        struct replica *r = w->replicas;
+        w->replicas = r->next;
+        replica_free(r);
+    }
+    if (w->fd != -1)
+        close(w->fd);
+    free(w->buf);
+    free(w->path);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->wake);
+    pthread_cond_destroy(&w->space);
+}
+
+void wal_append(struct wal *w, int type, uint32_t peer_id, const void *payload, size_t len) {
+    if (w == NULL)
+        return;
+    size_t record = WAL_RECORD_HEADER + WAL_PAYLOAD_HEADER + len;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->fd == -1 && w->replicas == NULL) {
+        // nobody to write it for; just keep the positions moving
+        w->end_lsn += record;
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+    while (!w->failed && w->len > 0 && w->len + record > WAL_MAX_BUFFER)
+        pthread_cond_wait(&w->space, &w->lock);
+    if (!w->failed && reserve(&w->buf, &w->capacity, w->len + record) == -1) {
+        // a gap would make replay wrong, so stop logging altogether
+        w->failed = 1;
+        log_printf(LOG_ERROR, "[ERROR] Out of memory for log %s, logging stopped\n", w->path ? w->path : "(replicas)");
+    }
+    if (w->failed) {
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+
+    encode(w->buf + w->len, type, peer_id, payload, len);
+    w->len += record;
+    w->end_lsn += record;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void wal_append_join(struct wal *w, const struct peer_entry *peer) {
+    if (w == NULL)
+        return;
+    const struct sockaddr_in *addr_in = (const struct sockaddr_in *)&peer->address;
+    unsigned char payload[6];
+    memcpy(payload, &addr_in->sin_addr.s_addr, 4);
+    memcpy(payload + 4, &addr_in->sin_port, 2);
+    wal_append(w, WAL_JOIN, peer->id, payload, sizeof payload);
+}
+
+void wal_append_files(struct wal *w, const struct registry *reg, const struct peer_entry *peer) {
+    if (w == NULL)
+        return;
+    size_t len;
+    char *names = peer_names(reg, peer, &len);
+    if (names == NULL) {
+        pthread_mutex_lock(&w->lock);
+        w->failed = 1;
+        pthread_mutex_unlock(&w->lock);
+        log_printf(LOG_ERROR, "[ERROR] Out of memory for log %s, logging stopped\n", w->path ? w->path : "(replicas)");
+        return;
+    }
+    wal_append(w, WAL_PUBLISH, peer->id, names, len);
+    free(names);
+}
+
+int wal_sync(struct wal *w) {
+    if (w == NULL || w->path == NULL)
+        return 0;
+    pthread_mutex_lock(&w->lock);
+    uint64_t lsn = w->end_lsn;
+    while (!w->failed && w->durable_lsn < lsn)
+        pthread_cond_wait(&w->space, &w->lock);
+    int failed = w->failed;
+    pthread_mutex_unlock(&w->lock);
+    return failed ? -1 : 0;
+}
+
+uint64_t wal_position(struct wal *w) {
+    if (w == NULL)
+        return 0;
+    pthread_mutex_lock(&w->lock);
+    uint64_t lsn = w->end_lsn;
+    pthread_mutex_unlock(&w->lock);
+    return lsn;
+}
+
+void wal_compact(struct wal *w, uint64_t lsn) {
+    if (w == NULL || w->path == NULL)
+        return;
+    pthread_mutex_lock(&w->lock);
+    if (lsn > w->compact_lsn) {
+        w->compact_lsn = lsn;
+        pthread_cond_signal(&w->wake);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
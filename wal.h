@@ -0,0 +1,114 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Append-only write-ahead log of registry mutations.
+ *
+ * Handlers append a record while they hold the registry's write lock, so
+ * the log order is the order the changes were applied. Appending only copies
+ * into a memory buffer. A background thread writes whatever has built up
+ * and syncs it with one fdatasync, then picks up what arrived meanwhile, so
+ * a burst of requests shares each sync (group commit).
+ *
+ * Records are keyed by peer id, since socket fds mean nothing after a
+ * restart. Replaying the log rebuilds those peers as ghosts (see
+ * registry.h); peers that shared an id end up merged into one.
+ *
+ * Positions in the log are LSNs: byte offsets that keep counting across
+ * compactions. A snapshot records the LSN it covers; once it is safely on
+ * disk, the log drops everything before that LSN.
+ *
+ * The same records feed replicas. A replica connection gets a dump of the
+ * registry as records, then every batch the writer has synced, from a
+ * thread of its own so a slow replica never holds up the sync. Without a
+ * log file the log keeps no records until a replica attaches.
+ */
+
+// Record types
+#define WAL_JOIN           1    // 4 byte IPv4 address, 2 byte port, network order
+#define WAL_PUBLISH        2    // null-terminated names replacing the peer's list
+#define WAL_PUBLISH_ADD    3    // null-terminated names
+#define WAL_PUBLISH_REMOVE 4    // null-terminated names
+#define WAL_LEAVE          5    // no payload
+
+// Each record is a 4 byte payload length and a 4 byte FNV-1a checksum of
+// the payload, in host byte order. The payload is a 1 byte type, the 4 byte
+// peer id and the type's data.
+#define WAL_RECORD_HEADER  8
+#define WAL_PAYLOAD_HEADER 5
+
+struct registry;
+struct peer_entry;
+struct replica;
+
+struct wal {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // records to write, compaction or shutdown
+    pthread_cond_t space;       // buffer drained
+    unsigned char *buf;         // appended, not yet written
+    size_t len;
+    size_t capacity;
+    uint64_t end_lsn;           // LSN after the last appended record
+    uint64_t durable_lsn;       // everything before this is synced
+    uint64_t compact_lsn;       // drop records before this at the next chance
+    uint64_t base_lsn;          // LSN of the file's first record
+    uint64_t batches;           // syncs done
+    int fd;
+    int stopping;
+    int failed;                 // a write or sync failed; appends are dropped
+    char *path;                 // NULL when only replicas are fed
+    struct replica *replicas;
+    pthread_t thread;
+};
+
+// Replays the log at path into reg, applying records from lsn on, before
+// any worker starts. A torn or corrupt tail (a crash mid-write) is cut off.
+// Sets *end_lsn to the LSN after the last good record and returns the number
+// of records applied, or -1 with errno set. A missing log is empty.
+long wal_replay(struct registry *reg, const char *path, uint64_t lsn, uint64_t *end_lsn);
+
+// Opens the log for appending at end_lsn (as returned by wal_replay) and
+// starts its writer thread; path may be NULL to run without a file.
+// Returns 0 or -1 with errno set.
+int wal_open(struct wal *w, const char *path, uint64_t end_lsn);
+// Syncs everything appended and stops the writer thread
+void wal_close(struct wal *w);
+
+// Appends a record; does nothing if w is NULL. Called with the registry's
+// write lock held. Blocks only if the writer is far behind.
+void wal_append(struct wal *w, int type, uint32_t peer_id, const void *payload, size_t len);
+// Appends a WAL_JOIN with the peer's current address
+void wal_append_join(struct wal *w, const struct peer_entry *peer);
+// Appends a WAL_PUBLISH of the peer's whole list
+void wal_append_files(struct wal *w, const struct registry *reg, const struct peer_entry *peer);
+// LSN after the last appended record; the caller holds the registry's write lock
+uint64_t wal_position(struct wal *w);
+// Lets the writer drop records before lsn, once a snapshot covering them is
+// on disk
+void wal_compact(struct wal *w, uint64_t lsn);
+
+// Starts feeding the blocking socket fd as a replica: first a dump of reg,
+// then every record appended from now on. Called with the registry's write
+// lock held so the dump and the stream meet exactly. Returns 0, or -1 if out
+// of memory, in which case fd is left alone.
+int wal_add_replica(struct wal *w, const struct registry *reg, int fd);
+
+// A replica takes its primary's stream in three steps, so that nothing
+// takes effect before it is in the replica's own log: wal_log_records()
+// checks the whole records at the start of buf and appends them to w,
+// setting *used to the bytes they take (-1 on a corrupt record);
+// wal_sync() waits for them to be synced; wal_apply_records() then applies
+// those used bytes to reg. Logging and applying are called with the
+// registry's write lock held.
+int wal_log_records(struct wal *w, const unsigned char *buf, size_t len, size_t *used);
+int wal_apply_records(struct registry *reg, const unsigned char *buf, size_t len);
+
+// Waits until everything appended so far is synced. Returns 0 at once
+// without a log file, or -1 if logging has failed.
+int wal_sync(struct wal *w);
+
+#endif